@@ -0,0 +1,15 @@
+
+/* GAME SETTINGS
+ * Edit attributes here
+ */
+renderer = "accelerated"; /* "accelerated" or "software", falls back to software */
+vsync = false;
+compositor = true; /* draw the map without textures when using the software renderer */
+parallax = true; /* draw sky and parallax layers behind the terrain */
+threads = 0; /* workers of the job system, 0 = all cores */
+sand = true; /* explosion rims and debris crumble and fall */
+render_thread = true; /* simulate the next tick while the current one is drawn */
+players = 1; /* players in a local match, Tab switches between them */
+stream_budget = 2; /* ms per frame spent finishing assets loaded in the background */
+music = []; /* WAV tracks streamed in the background and played in turn, empty for none */
+music_track_time = 180; /* seconds before crossfading to the next track */
@@ -2,16 +2,52 @@
 #define atlas_h
 
 #include <SDL2/SDL.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 extern SDL_Renderer *renderer;
 
+SDL_Texture *game_load_texture(const char *);
+void game_release_texture(SDL_Texture *);
+
+/* Manifest written by tools/atlaspack, see `make atlas` */
+#define ATLAS_PAGES_MANIFEST "assets/atlas/atlas.txt"
+
 typedef struct {
 	SDL_Texture *spritesheet;
 	SDL_Rect *sprites_src;
 	int allocated_sprites;
 } atlas_t;
 
+/*
+ * Image packed into a page by tools/atlaspack
+ */
+typedef struct {
+	char *name;
+	int page;
+	SDL_Rect rect;
+} atlas_packed_t;
+
+/*
+ * Pages of packed images and where each image is
+ * Page textures are only loaded once an atlas uses them.
+ */
+typedef struct {
+	char **page_paths;
+	int pages_count;
+	atlas_packed_t *images;
+	int images_count, images_max;
+} atlas_pages_t;
+
+atlas_pages_t atlas_pages = {
+	.page_paths = NULL,
+	.pages_count = 0,
+	.images = NULL,
+	.images_count = 0,
+	.images_max = 0
+};
+
 /*
  * Atlas holds information about spritesheet and its sprites
  */
@@ -29,9 +65,10 @@ atlas_t atlas_new(SDL_Texture *atlas, int sprites) {
 
 /*
  * Cleans up all the mess made by the atlas
+ * The spritesheet is released, other atlases may still use it
  */
 void atlas_delete(atlas_t *atl) {
-	SDL_DestroyTexture(atl->spritesheet);
+	game_release_texture(atl->spritesheet);
 	free(atl->sprites_src);
 }
 
@@ -66,4 +103,108 @@ void atlas_render_ex(atlas_t *atl, int sprite_id, SDL_Rect *dst, const double an
 	SDL_RenderCopyEx(renderer, atl->spritesheet, &atl->sprites_src[sprite_id], dst, angle, NULL, flip);
 }
 
+/*
+ * Reads the manifest `fn` into atlas_pages
+ * Returns 0 on success, without a manifest atlas_add_packed always fails
+ */
+int atlas_pages_load(const char *fn) {
+	FILE *f = fopen(fn, "r");
+	if (f == NULL)
+		return 1;
+
+	/* page files are next to the manifest */
+	const char *slash = strrchr(fn, '/');
+	const int dir_len = slash ? slash - fn + 1 : 0;
+
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		int page, x, y, w, h, name = 0;
+		char file[256];
+
+		if (sscanf(line, "page %d %255s", &page, file) == 2) {
+			if (page >= atlas_pages.pages_count) {
+				atlas_pages.page_paths = realloc(atlas_pages.page_paths, (page + 1) * sizeof(char *));
+				while (atlas_pages.pages_count <= page) {
+					atlas_pages.page_paths[atlas_pages.pages_count++] = NULL;
+				}
+			}
+			free(atlas_pages.page_paths[page]);
+			atlas_pages.page_paths[page] = malloc(dir_len + strlen(file) + 1);
+			memcpy(atlas_pages.page_paths[page], fn, dir_len);
+			strcpy(atlas_pages.page_paths[page] + dir_len, file);
+		} else if (sscanf(line, "sprite %d %d %d %d %d %n", &page, &x, &y, &w, &h, &name) == 5 && name > 0) {
+			if (atlas_pages.images_count == atlas_pages.images_max) {
+				atlas_pages.images_max = atlas_pages.images_max ? atlas_pages.images_max * 2 : 256;
+				atlas_pages.images = realloc(atlas_pages.images, atlas_pages.images_max * sizeof(atlas_packed_t));
+			}
+			atlas_packed_t *img = &atlas_pages.images[atlas_pages.images_count++];
+			img->name = malloc(strlen(line + name) + 1);
+			strcpy(img->name, line + name);
+			img->page = page;
+			img->rect = (SDL_Rect) {x, y, w, h};
+		}
+	}
+	fclose(f);
+
+	return 0;
+}
+
+/*
+ * Frees atlas_pages, page textures are released by the atlases using them
+ */
+void atlas_pages_delete() {
+	for (int i = 0; i < atlas_pages.pages_count; ++i) {
+		free(atlas_pages.page_paths[i]);
+	}
+	for (int i = 0; i < atlas_pages.images_count; ++i) {
+		free(atlas_pages.images[i].name);
+	}
+	free(atlas_pages.page_paths);
+	free(atlas_pages.images);
+	atlas_pages = (atlas_pages_t) {NULL, 0, NULL, 0, 0};
+}
+
+/*
+ * Returns the packed image `name` (path below assets/ without ".png"), NULL if it was not packed
+ */
+atlas_packed_t *atlas_pages_find(const char *name) {
+	for (int i = 0; i < atlas_pages.images_count; ++i) {
+		if (!strcmp(atlas_pages.images[i].name, name))
+			return &atlas_pages.images[i];
+	}
+	return NULL;
+}
+
+/*
+ * Adds the packed image `name` to `atl`, or the part `sub` of it (may be NULL)
+ * The atlas uses the image's page as spritesheet, all its sprites have to be on the same page
+ * Returns the id of the sprite or -1 if the image was not packed
+ */
+int atlas_add_packed(atlas_t *atl, const char *name, const SDL_Rect *sub) {
+	atlas_packed_t *img = atlas_pages_find(name);
+	if (img == NULL || img->page >= atlas_pages.pages_count)
+		return -1;
+
+	const char *page = atlas_pages.page_paths[img->page];
+	if (atl->spritesheet == NULL) {
+		atl->spritesheet = game_load_texture(page);
+		SDL_SetTextureBlendMode(atl->spritesheet, SDL_BLENDMODE_NONE);
+	} else {
+		/* the texture cache hands out the page's texture again */
+		SDL_Texture *tex = game_load_texture(page);
+		game_release_texture(tex);
+		if (tex != atl->spritesheet) {
+			printf("Packed image '%s' is not on the page of its atlas\n", name);
+			return -1;
+		}
+	}
+
+	SDL_Rect r = img->rect;
+	if (sub)
+		r = (SDL_Rect) {r.x + sub->x, r.y + sub->y, sub->w, sub->h};
+	atlas_add_sprite(atl, r.x, r.y, r.w, r.h);
+	return atl->allocated_sprites - 1;
+}
+
 #endif
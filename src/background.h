@@ -0,0 +1,169 @@
+#ifndef background_h
+#define background_h
+
+#include <math.h>
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+
+extern SDL_Renderer *renderer;
+extern int window_width, window_height;
+
+#define BACKGROUND_MAX_LAYERS 4
+
+typedef struct {
+	SDL_Texture *texture;
+	int w, h;
+	/* scroll rate relative to map::scroll, 0 = fixed to the screen, 1 = moves with the terrain */
+	float rate;
+	/* repeat horizontally */
+	int tiled;
+} background_layer_t;
+
+/*
+ * Static layers drawn behind the terrain, back to front
+ * Layers are uploaded once and never change
+ */
+typedef struct {
+	background_layer_t layers[BACKGROUND_MAX_LAYERS];
+	int layers_count;
+} background_t;
+
+/*
+ * Creates a background without layers
+ */
+background_t background_new() {
+	background_t bg = (background_t) {
+		.layers_count = 0
+	};
+
+	return bg;
+}
+
+/*
+ * Destroys all layer textures
+ */
+void background_delete(background_t *bg) {
+	for (int i = 0; i < bg->layers_count; ++i) {
+		SDL_DestroyTexture(bg->layers[i].texture);
+	}
+	bg->layers_count = 0;
+}
+
+/*
+ * Appends a layer in front of all other layers
+ */
+void background_add_layer(background_t *bg, SDL_Texture *tex, int w, int h, float rate, int tiled) {
+	if (tex == NULL)
+		return;
+	if (bg->layers_count == BACKGROUND_MAX_LAYERS) {
+		puts("Too many background layers!");
+		SDL_DestroyTexture(tex);
+		return;
+	}
+
+	bg->layers[bg->layers_count++] = (background_layer_t) {
+		.texture = tex,
+		.w = w,
+		.h = h,
+		.rate = rate,
+		.tiled = tiled
+	};
+}
+
+/*
+ * Adds a sky fading from color `top` to `bottom`, stretched over the whole screen
+ */
+void background_add_sky(background_t *bg, Uint32 top, Uint32 bottom) {
+	const int h = 256;
+	Uint32 pixels[256];
+	for (int y = 0; y < h; ++y) {
+		Uint32 r = ((top >> 16) & 0xFF) + (((int)((bottom >> 16) & 0xFF) - (int)((top >> 16) & 0xFF)) * y) / (h - 1);
+		Uint32 g = ((top >>  8) & 0xFF) + (((int)((bottom >>  8) & 0xFF) - (int)((top >>  8) & 0xFF)) * y) / (h - 1);
+		Uint32 b = ((top >>  0) & 0xFF) + (((int)((bottom >>  0) & 0xFF) - (int)((top >>  0) & 0xFF)) * y) / (h - 1);
+		pixels[y] = RGB(r, g, b);
+	}
+
+	SDL_Texture *tex = SDL_CreateTexture(renderer, game_texture_format, SDL_TEXTUREACCESS_STATIC, 1, h);
+	SDL_UpdateTexture(tex, NULL, pixels, sizeof(Uint32));
+	SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_NONE);
+	background_add_layer(bg, tex, 1, h, 0, 0);
+}
+
+/*
+ * Adds image `fn` as a horizontally repeating layer
+ * The color of the top left pixel is treated as transparent
+ */
+void background_add_image(background_t *bg, const char *fn, float rate) {
+	SDL_Surface *loaded = game_load_surface(fn);
+	if (loaded == NULL)
+		return;
+	SDL_Surface *surface = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_ARGB8888, 0);
+	SDL_FreeSurface(loaded);
+	if (surface == NULL) {
+		printf("Cannot convert image '%s': %s\n", fn, SDL_GetError());
+		return;
+	}
+
+	SDL_SetColorKey(surface, SDL_TRUE, ((Uint32 *)surface->pixels)[0]);
+	SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, surface);
+	if (tex == NULL) {
+		printf("Cannot create texture from surface ('%s'): %s\n", fn, SDL_GetError());
+	} else {
+		SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
+		background_add_layer(bg, tex, surface->w, surface->h, rate, 1);
+	}
+
+	SDL_FreeSurface(surface);
+}
+
+/*
+ * Adds the map background as a layer moving with the terrain
+ * Only tiles that are solid when this is called are kept, so destroyed terrain
+ * shows the background while open sky stays transparent
+ */
+void background_add_backdrop(background_t *bg, map_t *map) {
+	Uint32 *pixels = malloc(map->width * map->height * sizeof(Uint32));
+	for (int i = 0; i < map->width * map->height; ++i) {
+		pixels[i] = map->solid_tiles[i] ? (map->back_rgb_tiles[i] | MAP_SOLID_ALPHA) : 0;
+	}
+
+	SDL_Texture *tex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, map->width, map->height);
+	SDL_UpdateTexture(tex, NULL, pixels, map->width * sizeof(Uint32));
+	SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
+	free(pixels);
+
+	background_add_layer(bg, tex, map->width, map->height, 1, 0);
+}
+
+/*
+ * Draws all layers relative to the view of `map` (display_rect)
+ * Layers are aligned so their bottom meets the bottom of the screen when the map is scrolled all the way down
+ */
+void background_render(background_t *bg, map_t *map) {
+	const int view_w = map->display_rect.w,
+	          view_h = map->display_rect.h;
+
+	for (int i = 0; i < bg->layers_count; ++i) {
+		background_layer_t *l = &bg->layers[i];
+
+		/* fixed layers cover the whole screen */
+		if (l->rate == 0) {
+			SDL_RenderCopy(renderer, l->texture, NULL, NULL);
+			continue;
+		}
+
+		const int y = (view_h - l->h) + (map->height - view_h) * l->rate - map->display_rect.y * l->rate;
+		if (!l->tiled) {
+			SDL_Rect dst = (SDL_Rect) {-map->display_rect.x * l->rate, y, l->w, l->h};
+			SDL_RenderCopy(renderer, l->texture, NULL, &dst);
+			continue;
+		}
+
+		for (int x = -(int)fmodf(map->display_rect.x * l->rate, l->w); x < view_w; x += l->w) {
+			SDL_Rect dst = (SDL_Rect) {x, y, l->w, l->h};
+			SDL_RenderCopy(renderer, l->texture, NULL, &dst);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef compositor_h
+#define compositor_h
+
+#include <string.h>
+#include <SDL2/SDL.h>
+
+/*
+ * Software compositor
+ * Copies the visible part of the map straight into the window surface,
+ * skipping the streaming texture. Only used with the software renderer.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define COMPOSITOR_SIMD 1
+#endif
+
+/* Row copies used by compositor_blit, picked by compositor_init */
+void (*compositor_copy_row)(Uint32 *, const Uint32 *, int) = NULL;
+void (*compositor_keyed_row)(Uint32 *, const Uint32 *, int) = NULL;
+
+/*
+ * Copies `n` pixels from `src` to `dst`
+ */
+void compositor_copy_row_c(Uint32 *dst, const Uint32 *src, int n) {
+	memcpy(dst, src, n * sizeof(Uint32));
+}
+
+/*
+ * Copies the `n` pixels of `src` that have their alpha bit set to `dst`
+ */
+void compositor_keyed_row_c(Uint32 *dst, const Uint32 *src, int n) {
+	for (int i = 0; i < n; ++i) {
+		if (src[i] & 0x80000000)
+			dst[i] = src[i];
+	}
+}
+
+#ifdef COMPOSITOR_SIMD
+/*
+ * Copies `n` pixels from `src` to `dst`, 4 pixels at a time
+ */
+__attribute__((target("sse2")))
+void compositor_copy_row_sse2(Uint32 *dst, const Uint32 *src, int n) {
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i + 4));
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + i + 8));
+		__m128i d = _mm_loadu_si128((const __m128i *)(src + i + 12));
+		_mm_storeu_si128((__m128i *)(dst + i), a);
+		_mm_storeu_si128((__m128i *)(dst + i + 4), b);
+		_mm_storeu_si128((__m128i *)(dst + i + 8), c);
+		_mm_storeu_si128((__m128i *)(dst + i + 12), d);
+	}
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_loadu_si128((const __m128i *)(src + i)));
+	}
+	for (; i < n; ++i) {
+		dst[i] = src[i];
+	}
+}
+
+/*
+ * Copies the `n` pixels of `src` that have their alpha bit set to `dst`, 4 pixels at a time
+ */
+__attribute__((target("sse2")))
+void compositor_keyed_row_sse2(Uint32 *dst, const Uint32 *src, int n) {
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		/* spread the alpha bit over the whole pixel */
+		__m128i mask = _mm_srai_epi32(s, 31);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_and_si128(mask, s), _mm_andnot_si128(mask, d)));
+	}
+	compositor_keyed_row_c(dst + i, src + i, n - i);
+}
+
+/*
+ * Copies `n` pixels from `src` to `dst`, 8 pixels at a time
+ */
+__attribute__((target("avx2")))
+void compositor_copy_row_avx2(Uint32 *dst, const Uint32 *src, int n) {
+	int i = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 8));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(src + i + 24));
+		_mm256_storeu_si256((__m256i *)(dst + i), a);
+		_mm256_storeu_si256((__m256i *)(dst + i + 8), b);
+		_mm256_storeu_si256((__m256i *)(dst + i + 16), c);
+		_mm256_storeu_si256((__m256i *)(dst + i + 24), d);
+	}
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+	}
+	for (; i < n; ++i) {
+		dst[i] = src[i];
+	}
+}
+
+/*
+ * Copies the `n` pixels of `src` that have their alpha bit set to `dst`, 8 pixels at a time
+ */
+__attribute__((target("avx2")))
+void compositor_keyed_row_avx2(Uint32 *dst, const Uint32 *src, int n) {
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_blendv_epi8(d, s, _mm256_srai_epi32(s, 31)));
+	}
+	compositor_keyed_row_c(dst + i, src + i, n - i);
+}
+#endif
+
+/*
+ * Picks the fastest row copies the cpu supports
+ */
+void compositor_init() {
+	compositor_copy_row = &compositor_copy_row_c;
+	compositor_keyed_row = &compositor_keyed_row_c;
+#ifdef COMPOSITOR_SIMD
+	if (SDL_HasAVX2()) {
+		compositor_copy_row = &compositor_copy_row_avx2;
+		compositor_keyed_row = &compositor_keyed_row_avx2;
+	} else if (SDL_HasSSE2()) {
+		compositor_copy_row = &compositor_copy_row_sse2;
+		compositor_keyed_row = &compositor_keyed_row_sse2;
+	}
+#endif
+}
+
+/*
+ * Copies the `w` x `h` window at `sx`,`sy` of `tiles` (`tiles_w` x `tiles_h`) to the top left of `dst`
+ * `dst` has to be in a format matching the tiles (see game_format_matches_tiles)
+ * If `keyed` is set, tiles without alpha leave `dst` untouched
+ */
+void compositor_blit(SDL_Surface *dst, const Uint32 *tiles, const int tiles_w, const int tiles_h, int sx, int sy, int w, int h, int keyed) {
+	/* clip to tiles and surface */
+	if (sx < 0) { w += sx; sx = 0; }
+	if (sy < 0) { h += sy; sy = 0; }
+	if (sx + w > tiles_w) w = tiles_w - sx;
+	if (sy + h > tiles_h) h = tiles_h - sy;
+	if (w > dst->w) w = dst->w;
+	if (h > dst->h) h = dst->h;
+	if (w <= 0 || h <= 0)
+		return;
+
+	if (SDL_MUSTLOCK(dst))
+		SDL_LockSurface(dst);
+
+	void (*row)(Uint32 *, const Uint32 *, int) = keyed ? compositor_keyed_row : compositor_copy_row;
+	const Uint32 *src_row = tiles + sx + sy * tiles_w;
+	Uint8 *dst_row = dst->pixels;
+	for (int y = 0; y < h; ++y) {
+		row((Uint32 *)dst_row, src_row, w);
+		src_row += tiles_w;
+		dst_row += dst->pitch;
+	}
+
+	if (SDL_MUSTLOCK(dst))
+		SDL_UnlockSurface(dst);
+}
+
+#endif
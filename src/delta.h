@@ -0,0 +1,334 @@
+#ifndef delta_h
+#define delta_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+/*
+ * Terrain deltas
+ * Describes how the terrain changed since a tick, for save games, replays and
+ * network sync. Edits of the edit buffer are sent as they are, chunks changed
+ * by anything else (sand, islands, debris) are sent as run-length encoded tiles.
+ *
+ * Layout, all numbers little-endian:
+ *   u32 magic, u32 from tick, u32 to tick, u32 edit count, u32 chunk count
+ *   edits:  u8 kind, u8 solid, i32 x, i32 y, i16 w, i16 h, u32 color
+ *   chunks: u32 chunk, u16 run count, runs of (u16 length, u32 tile)
+ * A tile is the color with MAP_SOLID_ALPHA if solid, 0 for the background.
+ * Edits are applied before the chunks, which carry their final state.
+ * If the edits since a tick were already forgotten, every chunk changed since
+ * then is sent as tiles instead.
+ */
+
+#define DELTA_MAGIC 0x544C4454 /* "TDLT" */
+/* Bytes of the header and of an edit */
+#define DELTA_HEADER_SIZE 20
+#define DELTA_EDIT_SIZE 18
+
+/*
+ * Edit applied in `tick`
+ */
+typedef struct {
+	Uint32 tick;
+	map_edit_t edit;
+} delta_entry_t;
+
+/*
+ * History of applied edits
+ */
+typedef struct delta_t {
+	delta_entry_t *entries;
+	int entries_count, entries_max;
+	/* edits of this tick and before were dropped */
+	Uint32 forgotten;
+} delta_t;
+
+/*
+ * Growing byte buffer
+ */
+typedef struct {
+	Uint8 *data;
+	int size, max;
+} delta_writer_t;
+
+/*
+ * Position in an encoded delta, `error` is set when reading past its end
+ */
+typedef struct {
+	const Uint8 *data;
+	int size, pos;
+	int error;
+} delta_reader_t;
+
+/*
+ * Creates an empty history
+ */
+delta_t delta_new() {
+	delta_t delta = (delta_t) {
+		.entries = NULL,
+		.entries_count = 0,
+		.entries_max = 0,
+		.forgotten = 0
+	};
+
+	return delta;
+}
+
+/*
+ * Frees the history
+ */
+void delta_delete(delta_t *delta) {
+	free(delta->entries);
+}
+
+/*
+ * Adds the edits queued on `map` to the history, called by map_apply_edits
+ */
+void delta_record(delta_t *delta, map_t *map) {
+	for (int i = 0; i < map->edits_count; ++i) {
+		if (delta->entries_count == delta->entries_max) {
+			delta->entries_max = delta->entries_max ? delta->entries_max * 2 : 64;
+			delta->entries = realloc(delta->entries, delta->entries_max * sizeof(delta_entry_t));
+		}
+		delta->entries[delta->entries_count++] = (delta_entry_t) {map->tick, map->edits[i]};
+	}
+}
+
+/*
+ * Drops edits of `tick` and before, once nobody needs a delta from before `tick` anymore
+ */
+void delta_forget(delta_t *delta, Uint32 tick) {
+	int keep = 0;
+	while (keep < delta->entries_count && delta->entries[keep].tick <= tick) {
+		++keep;
+	}
+	memmove(delta->entries, &delta->entries[keep], (delta->entries_count - keep) * sizeof(delta_entry_t));
+	delta->entries_count -= keep;
+	if (tick > delta->forgotten)
+		delta->forgotten = tick;
+}
+
+/*
+ * Appends the lowest `bytes` bytes of `value`
+ */
+void delta_put(delta_writer_t *w, Uint32 value, int bytes) {
+	if (w->size + bytes > w->max) {
+		w->max = w->max ? w->max * 2 : 1024;
+		w->data = realloc(w->data, w->max);
+	}
+	for (int i = 0; i < bytes; ++i) {
+		w->data[w->size++] = (value >> (i * 8)) & 0xFF;
+	}
+}
+
+/*
+ * Reads a number of `bytes` bytes
+ */
+Uint32 delta_get(delta_reader_t *r, int bytes) {
+	if (r->pos + bytes > r->size) {
+		r->error = 1;
+		return 0;
+	}
+	Uint32 value = 0;
+	for (int i = 0; i < bytes; ++i) {
+		value |= (Uint32)r->data[r->pos++] << (i * 8);
+	}
+	return value;
+}
+
+/*
+ * Returns tile `i` as it is encoded in deltas
+ */
+Uint32 delta_tile(map_t *map, const int i) {
+	return map->solid_tiles[i] ? (map->rgb_tiles[i] | MAP_SOLID_ALPHA) : 0;
+}
+
+/*
+ * Run-length encodes the tiles of `chunk`
+ */
+void delta_put_chunk(delta_writer_t *w, map_t *map, const int chunk) {
+	const int x0 = (chunk % map->chunks_w) << MAP_CHUNK_SHIFT,
+	          y0 = (chunk / map->chunks_w) << MAP_CHUNK_SHIFT;
+	int x1 = x0 + MAP_CHUNK_SIZE, y1 = y0 + MAP_CHUNK_SIZE;
+	if (x1 > map->width) x1 = map->width;
+	if (y1 > map->height) y1 = map->height;
+
+	delta_put(w, chunk, 4);
+	/* run count is filled in at the end */
+	const int runs_pos = w->size;
+	delta_put(w, 0, 2);
+
+	int runs = 0, length = 0;
+	Uint32 value = 0;
+	for (int y = y0; y < y1; ++y) {
+		for (int x = x0; x < x1; ++x) {
+			const Uint32 tile = delta_tile(map, x + y * map->width);
+			if (length > 0 && tile == value) {
+				++length;
+				continue;
+			}
+			if (length > 0) {
+				delta_put(w, length, 2);
+				delta_put(w, value, 4);
+				++runs;
+			}
+			value = tile;
+			length = 1;
+		}
+	}
+	delta_put(w, length, 2);
+	delta_put(w, value, 4);
+	++runs;
+
+	w->data[runs_pos] = runs & 0xFF;
+	w->data[runs_pos + 1] = runs >> 8;
+}
+
+/*
+ * Returns 1 if `chunk` has to be sent as tiles in a delta from `since`
+ * Without `replay`, edits are not sent and their chunks count as well
+ */
+int delta_chunk_changed(map_t *map, const int chunk, Uint32 since, int replay) {
+	return map->chunk_ticks[chunk] > since || (!replay && map->chunk_edit_ticks[chunk] > since);
+}
+
+/*
+ * Returns the bytes of all chunks of `map` as tiles, when no two neighbouring tiles are the same
+ */
+int delta_tiles_size(map_t *map) {
+	return map->chunks_w * map->chunks_h * 6 + map->width * map->height * 6;
+}
+
+/*
+ * Returns the size of the largest delta of `map` delta_encode makes
+ * Edits are only replayed while they take no more bytes than the tiles would
+ */
+int delta_max_size(map_t *map) {
+	return DELTA_HEADER_SIZE + 2 * delta_tiles_size(map);
+}
+
+/*
+ * Encodes all changes to `map` after tick `since`
+ * Returns a buffer of `*size` bytes that has to be freed
+ */
+Uint8 *delta_encode(delta_t *delta, map_t *map, Uint32 since, int *size) {
+	delta_writer_t w = (delta_writer_t) {NULL, 0, 0};
+	int replay = since >= delta->forgotten;
+
+	int edits = 0;
+	for (int i = 0; i < delta->entries_count && replay; ++i) {
+		if (delta->entries[i].tick > since)
+			++edits;
+	}
+	/* sending the tiles is cheaper, see delta_max_size */
+	if (replay && edits * DELTA_EDIT_SIZE > delta_tiles_size(map)) {
+		replay = 0;
+		edits = 0;
+	}
+	int chunks = 0;
+	for (int i = 0; i < map->chunks_w * map->chunks_h; ++i) {
+		if (delta_chunk_changed(map, i, since, replay))
+			++chunks;
+	}
+
+	delta_put(&w, DELTA_MAGIC, 4);
+	delta_put(&w, since, 4);
+	delta_put(&w, map->tick, 4);
+	delta_put(&w, edits, 4);
+	delta_put(&w, chunks, 4);
+
+	for (int i = 0; i < delta->entries_count && replay; ++i) {
+		if (delta->entries[i].tick <= since)
+			continue;
+		map_edit_t *e = &delta->entries[i].edit;
+		delta_put(&w, e->kind, 1);
+		delta_put(&w, e->solid, 1);
+		delta_put(&w, e->x, 4);
+		delta_put(&w, e->y, 4);
+		delta_put(&w, e->w, 2);
+		delta_put(&w, e->h, 2);
+		delta_put(&w, e->c, 4);
+	}
+
+	for (int i = 0; i < map->chunks_w * map->chunks_h; ++i) {
+		if (delta_chunk_changed(map, i, since, replay))
+			delta_put_chunk(&w, map, i);
+	}
+
+	*size = w.size;
+	return w.data;
+}
+
+/*
+ * Applies a delta made by delta_encode to `map`, which has to be in the state of the delta's from tick
+ * Edits already queued on `map` are applied along with it
+ * Returns 0 on success
+ */
+int delta_apply(map_t *map, const Uint8 *data, const int size) {
+	delta_reader_t r = (delta_reader_t) {data, size, 0, 0};
+
+	if (delta_get(&r, 4) != DELTA_MAGIC) {
+		printf("Invalid terrain delta\n");
+		return 1;
+	}
+	delta_get(&r, 4);
+	const Uint32 to = delta_get(&r, 4);
+	const int edits = delta_get(&r, 4),
+	          chunks = delta_get(&r, 4);
+	map->tick = to;
+
+	for (int i = 0; i < edits && !r.error; ++i) {
+		map_edit_t e;
+		e.kind = delta_get(&r, 1);
+		e.solid = delta_get(&r, 1);
+		e.x = (Sint32)delta_get(&r, 4);
+		e.y = (Sint32)delta_get(&r, 4);
+		e.w = (Sint16)delta_get(&r, 2);
+		e.h = (Sint16)delta_get(&r, 2);
+		e.c = delta_get(&r, 4);
+		if (e.kind > MAP_EDIT_EXPLODE) {
+			printf("Invalid terrain delta: unknown edit %d\n", e.kind);
+			return 1;
+		}
+		map_queue_edit(map, e);
+	}
+	map_apply_edits(map);
+
+	for (int i = 0; i < chunks && !r.error; ++i) {
+		const int chunk = delta_get(&r, 4);
+		int runs = delta_get(&r, 2);
+		if (chunk < 0 || chunk >= map->chunks_w * map->chunks_h) {
+			printf("Invalid terrain delta: chunk %d out of range\n", chunk);
+			return 1;
+		}
+
+		const int x0 = (chunk % map->chunks_w) << MAP_CHUNK_SHIFT,
+		          y0 = (chunk / map->chunks_w) << MAP_CHUNK_SHIFT;
+		int x1 = x0 + MAP_CHUNK_SIZE, y1 = y0 + MAP_CHUNK_SIZE;
+		if (x1 > map->width) x1 = map->width;
+		if (y1 > map->height) y1 = map->height;
+
+		int x = x0, y = y0;
+		while (runs-- > 0 && !r.error) {
+			int length = delta_get(&r, 2);
+			const Uint32 tile = delta_get(&r, 4);
+			for (; length > 0 && y < y1; --length) {
+				map_set_solid(map, x, y, tile, (tile & MAP_SOLID_ALPHA) != 0);
+				if (++x == x1) {
+					x = x0;
+					++y;
+				}
+			}
+		}
+	}
+
+	if (r.error) {
+		printf("Invalid terrain delta: truncated\n");
+		return 1;
+	}
+	return 0;
+}
+
+#endif
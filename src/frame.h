@@ -0,0 +1,361 @@
+#ifndef frame_h
+#define frame_h
+
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+#include <SDL2/SDL2_gfxPrimitives.h>
+#include "vector.h"
+#include "map.h"
+#include "atlas.h"
+
+extern SDL_Renderer *renderer;
+
+/*
+ * Render snapshot
+ * The simulation describes what to draw in a frame_t instead of drawing it.
+ * Everything in it is copied, so the thread owning the renderer can draw it
+ * while the simulation already works on the next tick.
+ */
+
+/*
+ * Sprite of an atlas, `dst` is in screen coordinates
+ */
+typedef struct {
+	atlas_t *atlas;
+	int id;
+	SDL_Rect dst;
+	double angle;
+	SDL_RendererFlip flip;
+} frame_sprite_t;
+
+/*
+ * Antialiased circle outline in screen coordinates
+ */
+typedef struct {
+	Sint16 x, y, r;
+	Uint8 red, green, blue, alpha;
+} frame_circle_t;
+
+/*
+ * Terrain area that changed, its pixels are stored at `offset` in frame_t::pixels
+ */
+typedef struct {
+	SDL_Rect rect;
+	int offset;
+} frame_chunk_t;
+
+/*
+ * Particle in screen coordinates
+ */
+typedef struct {
+	int x, y;
+	Uint32 color;
+} frame_particle_t;
+
+typedef struct {
+	vector_t scroll;
+
+	frame_sprite_t *sprites;
+	int sprites_count, sprites_max;
+	frame_circle_t *circles;
+	int circles_count, circles_max;
+
+	/* terrain to upload before drawing the map */
+	frame_chunk_t *chunks;
+	int chunks_count, chunks_max;
+	Uint32 *pixels;
+	int pixels_count, pixels_max;
+
+	frame_particle_t *particles;
+	int particles_count, particles_max;
+} frame_t;
+
+/*
+ * Two frames handed from the simulation thread to the render thread
+ * The simulation fills `back` while the renderer draws the other frame.
+ * Frames are never dropped, since they carry terrain changes.
+ */
+typedef struct {
+	frame_t frames[2];
+	/* frame filled by the simulation */
+	int back;
+	/* frame waiting to be drawn and frame being drawn, -1 if none */
+	int submitted, drawing;
+
+	/* input last sampled by the render thread */
+	game_input_t input;
+	int running;
+
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+} frame_queue_t;
+
+/*
+ * Creates an empty frame
+ */
+frame_t frame_new() {
+	frame_t frame = (frame_t) {
+		.scroll = vector_new(0, 0),
+		.sprites = NULL, .sprites_count = 0, .sprites_max = 0,
+		.circles = NULL, .circles_count = 0, .circles_max = 0,
+		.chunks = NULL, .chunks_count = 0, .chunks_max = 0,
+		.pixels = NULL, .pixels_count = 0, .pixels_max = 0,
+		.particles = NULL, .particles_count = 0, .particles_max = 0
+	};
+
+	return frame;
+}
+
+/*
+ * Frees the frame
+ */
+void frame_delete(frame_t *frame) {
+	free(frame->sprites);
+	free(frame->circles);
+	free(frame->chunks);
+	free(frame->pixels);
+	free(frame->particles);
+}
+
+/*
+ * Makes room for `needed` items of `size` bytes in `*items`, which has room for `*max`
+ * Doubles the buffer until it is large enough
+ */
+void frame_reserve(void **items, int *max, int needed, size_t size) {
+	if (needed <= *max)
+		return;
+
+	int n = *max ? *max : 64;
+	while (n < needed) {
+		n *= 2;
+	}
+	*items = realloc(*items, n * size);
+	*max = n;
+}
+
+/*
+ * Copies the dirty chunks near the viewport of `map` into `frame` and marks them clean
+ * Chunks further away stay dirty until they scroll into view
+ */
+void frame_capture_terrain(frame_t *frame, map_t *map) {
+	/* chunks intersecting the viewport and its margin */
+	int cx0 = ((int)map->scroll.x - MAP_UPLOAD_MARGIN) >> MAP_CHUNK_SHIFT,
+	    cy0 = ((int)map->scroll.y - MAP_UPLOAD_MARGIN) >> MAP_CHUNK_SHIFT,
+	    cx1 = ((int)map->scroll.x + map->display_rect.w + MAP_UPLOAD_MARGIN) >> MAP_CHUNK_SHIFT,
+	    cy1 = ((int)map->scroll.y + map->display_rect.h + MAP_UPLOAD_MARGIN) >> MAP_CHUNK_SHIFT;
+	if (cx0 < 0) cx0 = 0;
+	if (cy0 < 0) cy0 = 0;
+	if (cx1 >= map->chunks_w) cx1 = map->chunks_w - 1;
+	if (cy1 >= map->chunks_h) cy1 = map->chunks_h - 1;
+
+	for (int cy = cy0; cy <= cy1; ++cy) {
+		char *row = &map->dirty_chunks[cy * map->chunks_w];
+		for (int cx = cx0; cx <= cx1; ++cx) {
+			if (!row[cx])
+				continue;
+
+			/* copy runs of dirty chunks at once */
+			int run = cx;
+			while (run <= cx1 && row[run]) {
+				row[run++] = 0;
+			}
+
+			SDL_Rect rect = (SDL_Rect) {
+				cx << MAP_CHUNK_SHIFT,
+				cy << MAP_CHUNK_SHIFT,
+				(run - cx) << MAP_CHUNK_SHIFT,
+				MAP_CHUNK_SIZE
+			};
+			if (rect.x + rect.w > map->width) rect.w = map->width - rect.x;
+			if (rect.y + rect.h > map->height) rect.h = map->height - rect.y;
+
+			frame_reserve((void **)&frame->chunks, &frame->chunks_max, frame->chunks_count + 1, sizeof(frame_chunk_t));
+			frame_reserve((void **)&frame->pixels, &frame->pixels_max, frame->pixels_count + rect.w * rect.h, sizeof(Uint32));
+			frame->chunks[frame->chunks_count++] = (frame_chunk_t) {rect, frame->pixels_count};
+
+			for (int y = 0; y < rect.h; ++y) {
+				memcpy(&frame->pixels[frame->pixels_count + y * rect.w], &map->rgb_tiles[rect.x + (rect.y + y) * map->width], rect.w * sizeof(Uint32));
+			}
+			frame->pixels_count += rect.w * rect.h;
+			cx = run;
+		}
+	}
+}
+
+/*
+ * Empties `frame` and starts describing the current state of `map`
+ */
+void frame_begin(frame_t *frame, map_t *map) {
+	frame->scroll = map->scroll;
+	frame->sprites_count = 0;
+	frame->circles_count = 0;
+	frame->chunks_count = 0;
+	frame->pixels_count = 0;
+	frame->particles_count = 0;
+
+	frame_capture_terrain(frame, map);
+}
+
+/*
+ * Adds sprite `id` of `atlas` at `dst` (screen coordinates)
+ */
+void frame_add_sprite(frame_t *frame, atlas_t *atlas, int id, SDL_Rect *dst, double angle, SDL_RendererFlip flip) {
+	frame_reserve((void **)&frame->sprites, &frame->sprites_max, frame->sprites_count + 1, sizeof(frame_sprite_t));
+	frame->sprites[frame->sprites_count++] = (frame_sprite_t) {atlas, id, *dst, angle, flip};
+}
+
+/*
+ * Adds a circle outline at `x`,`y` (screen coordinates)
+ */
+void frame_add_circle(frame_t *frame, int x, int y, int r, Uint8 red, Uint8 green, Uint8 blue, Uint8 alpha) {
+	frame_reserve((void **)&frame->circles, &frame->circles_max, frame->circles_count + 1, sizeof(frame_circle_t));
+	frame->circles[frame->circles_count++] = (frame_circle_t) {x, y, r, red, green, blue, alpha};
+}
+
+/*
+ * Uploads the terrain stored in `frame` and moves the view of `map` to the frame's scroll
+ * Has to be called on the thread owning the renderer, before anything of `map` is drawn
+ */
+void frame_show_terrain(frame_t *frame, map_t *map) {
+	map->display_rect.x = frame->scroll.x;
+	map->display_rect.y = frame->scroll.y;
+
+	for (int i = 0; i < frame->chunks_count; ++i) {
+		frame_chunk_t *chunk = &frame->chunks[i];
+		map_upload(map, &chunk->rect, &frame->pixels[chunk->offset], chunk->rect.w * sizeof(Uint32));
+	}
+}
+
+/*
+ * Draws the sprites and circles of `frame`
+ * Has to be called on the thread owning the renderer
+ */
+void frame_render(frame_t *frame) {
+	for (int i = 0; i < frame->sprites_count; ++i) {
+		frame_sprite_t *s = &frame->sprites[i];
+		atlas_render_ex(s->atlas, s->id, &s->dst, s->angle, s->flip);
+	}
+	for (int i = 0; i < frame->circles_count; ++i) {
+		frame_circle_t *c = &frame->circles[i];
+		aacircleRGBA(renderer, c->x, c->y, c->r, c->red, c->green, c->blue, c->alpha);
+	}
+}
+
+/*
+ * Creates a queue with two empty frames
+ */
+frame_queue_t frame_queue_new() {
+	frame_queue_t queue = (frame_queue_t) {
+		.frames = {frame_new(), frame_new()},
+		.back = 0,
+		.submitted = -1,
+		.drawing = -1,
+		.running = 1,
+		.mutex = SDL_CreateMutex(),
+		.cond = SDL_CreateCond()
+	};
+	memset(&queue.input, 0, sizeof(game_input_t));
+
+	return queue;
+}
+
+/*
+ * Frees the queue and its frames
+ */
+void frame_queue_delete(frame_queue_t *queue) {
+	frame_delete(&queue->frames[0]);
+	frame_delete(&queue->frames[1]);
+	SDL_DestroyCond(queue->cond);
+	SDL_DestroyMutex(queue->mutex);
+}
+
+/*
+ * Stops the queue, threads waiting on it return
+ */
+void frame_queue_stop(frame_queue_t *queue) {
+	SDL_LockMutex(queue->mutex);
+	queue->running = 0;
+	SDL_CondBroadcast(queue->cond);
+	SDL_UnlockMutex(queue->mutex);
+}
+
+/*
+ * Hands the latest input to the simulation
+ */
+void frame_queue_set_input(frame_queue_t *queue, game_input_t *input) {
+	SDL_LockMutex(queue->mutex);
+	queue->input = *input;
+	SDL_UnlockMutex(queue->mutex);
+}
+
+/*
+ * Copies the latest input to `input`
+ * Returns 0 if the queue was stopped
+ */
+int frame_queue_get_input(frame_queue_t *queue, game_input_t *input) {
+	SDL_LockMutex(queue->mutex);
+	*input = queue->input;
+	const int running = queue->running;
+	SDL_UnlockMutex(queue->mutex);
+	return running;
+}
+
+/*
+ * Returns the frame the simulation fills next
+ */
+frame_t *frame_queue_back(frame_queue_t *queue) {
+	return &queue->frames[queue->back];
+}
+
+/*
+ * Passes the back frame to the renderer
+ * Waits until the previous frame was taken and the next back frame is no longer drawn
+ */
+void frame_queue_submit(frame_queue_t *queue) {
+	SDL_LockMutex(queue->mutex);
+	while (queue->running && queue->submitted != -1) {
+		SDL_CondWait(queue->cond, queue->mutex);
+	}
+	queue->submitted = queue->back;
+	queue->back ^= 1;
+	SDL_CondBroadcast(queue->cond);
+
+	while (queue->running && queue->drawing == queue->back) {
+		SDL_CondWait(queue->cond, queue->mutex);
+	}
+	SDL_UnlockMutex(queue->mutex);
+}
+
+/*
+ * Waits for the next submitted frame, which has to be released after drawing it
+ * Returns NULL if the queue was stopped
+ */
+frame_t *frame_queue_take(frame_queue_t *queue) {
+	SDL_LockMutex(queue->mutex);
+	while (queue->running && queue->submitted == -1) {
+		SDL_CondWait(queue->cond, queue->mutex);
+	}
+	if (!queue->running) {
+		SDL_UnlockMutex(queue->mutex);
+		return NULL;
+	}
+	queue->drawing = queue->submitted;
+	queue->submitted = -1;
+	SDL_CondBroadcast(queue->cond);
+	SDL_UnlockMutex(queue->mutex);
+
+	return &queue->frames[queue->drawing];
+}
+
+/*
+ * Gives the frame returned by frame_queue_take back to the simulation
+ */
+void frame_queue_release(frame_queue_t *queue) {
+	SDL_LockMutex(queue->mutex);
+	queue->drawing = -1;
+	SDL_CondBroadcast(queue->cond);
+	SDL_UnlockMutex(queue->mutex);
+}
+
+#endif
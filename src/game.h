@@ -5,14 +5,202 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_mixer.h>
+#include "duktape.h"
 #include "lodepng.h"
 #include "vector.h"
+#include "compositor.h"
+#include "pack.h"
 
 extern SDL_Window *window;
 extern SDL_Renderer *renderer;
 
+int stream_finish(const char *);
+
+/* Renderer capabilities, filled in by game_init */
+int game_renderer_accelerated = 0;
+/* Pixel format used for streaming textures, always laid out like rgb_tiles (0x..RRGGBB, the top byte is only opacity on layered maps) */
+Uint32 game_texture_format = SDL_PIXELFORMAT_RGB888;
+/* Use the software compositor if the renderer ends up being software */
+int game_compositor = 0;
+/* Draw the terrain over parallax background layers */
+int game_parallax = 0;
+/* Simulate loose tiles (sand, rubble) */
+int game_sand = 0;
+/* Workers of the job system, 0 uses all cores */
+int game_threads = 1;
+/* Simulate on a separate thread while the main thread draws the previous tick */
+int game_render_thread = 0;
+/* Players of a local match */
+int game_players = 1;
+/* Milliseconds per frame spent turning streamed assets into textures and sounds */
+float game_stream_budget = 2;
+/* Tracks the music player plays in turn, each for `game_music_track_time` seconds */
+#define GAME_MUSIC_TRACKS 16
+char game_music_tracks[GAME_MUSIC_TRACKS][256];
+int game_music_tracks_count = 0;
+float game_music_track_time = 180;
+/* Window surface the compositor draws to, NULL if the compositor is not used */
+SDL_Surface *game_surface = NULL;
+
+/*
+ * Texture loaded by game_load_texture, shared by every load of the same file
+ */
+typedef struct {
+	char *path;
+	SDL_Texture *texture;
+	int refs;
+} game_texture_entry_t;
+
+typedef struct {
+	game_texture_entry_t *entries;
+	int entries_count, entries_max;
+	SDL_SpinLock lock;
+} game_texture_cache_t;
+
+game_texture_cache_t game_textures = {
+	.entries = NULL,
+	.entries_count = 0,
+	.entries_max = 0,
+	.lock = 0
+};
+
+/*
+ * Loads game settings from `fn`
+ * Returns the renderer flags to pass to game_init
+ */
+Uint32 game_loadconfig(const char *fn) {
+	Uint32 rendererflags = SDL_RENDERER_ACCELERATED;
+	duk_context *ctx = duk_create_heap_default();
+	
+	if (duk_peval_file(ctx, fn) != 0) {
+		printf("Failed to eval '%s': %s\n", fn, duk_to_string(ctx, -1));
+		duk_destroy_heap(ctx);
+		return rendererflags;
+	}
+	
+	duk_get_global_string(ctx, "renderer");
+	if (duk_is_string(ctx, -1) && !strcmp(duk_get_string(ctx, -1), "software"))
+		rendererflags = SDL_RENDERER_SOFTWARE;
+	duk_pop(ctx);
+	duk_get_global_string(ctx, "vsync");
+	if (duk_to_boolean(ctx, -1))
+		rendererflags |= SDL_RENDERER_PRESENTVSYNC;
+	duk_pop(ctx);
+	duk_get_global_string(ctx, "compositor");
+	game_compositor = duk_to_boolean(ctx, -1);
+	duk_pop(ctx);
+	duk_get_global_string(ctx, "parallax");
+	game_parallax = duk_to_boolean(ctx, -1);
+	duk_pop(ctx);
+	duk_get_global_string(ctx, "sand");
+	game_sand = duk_to_boolean(ctx, -1);
+	duk_pop(ctx);
+	duk_get_global_string(ctx, "threads");
+	game_threads = duk_to_int(ctx, -1);
+	duk_pop(ctx);
+	if (game_threads <= 0)
+		game_threads = SDL_GetCPUCount();
+	duk_get_global_string(ctx, "render_thread");
+	game_render_thread = duk_to_boolean(ctx, -1);
+	duk_pop(ctx);
+	duk_get_global_string(ctx, "players");
+	game_players = duk_to_int(ctx, -1);
+	duk_pop(ctx);
+	if (game_players < 1)
+		game_players = 1;
+	duk_get_global_string(ctx, "stream_budget");
+	if (duk_is_number(ctx, -1))
+		game_stream_budget = duk_get_number(ctx, -1);
+	duk_pop(ctx);
+	/* a single track or a list of them */
+	duk_get_global_string(ctx, "music");
+	if (duk_is_string(ctx, -1) && duk_get_length(ctx, -1) > 0) {
+		snprintf(game_music_tracks[0], sizeof(game_music_tracks[0]), "%s", duk_get_string(ctx, -1));
+		game_music_tracks_count = 1;
+	} else if (duk_is_array(ctx, -1)) {
+		const int count = duk_get_length(ctx, -1);
+		for (int i = 0; i < count && game_music_tracks_count < GAME_MUSIC_TRACKS; ++i) {
+			duk_get_prop_index(ctx, -1, i);
+			if (duk_is_string(ctx, -1))
+				snprintf(game_music_tracks[game_music_tracks_count++], sizeof(game_music_tracks[0]), "%s", duk_get_string(ctx, -1));
+			duk_pop(ctx);
+		}
+	}
+	duk_pop(ctx);
+	duk_get_global_string(ctx, "music_track_time");
+	if (duk_is_number(ctx, -1) && duk_get_number(ctx, -1) > 0)
+		game_music_track_time = duk_get_number(ctx, -1);
+	duk_pop(ctx);
+
+	duk_destroy_heap(ctx);
+	return rendererflags;
+}
+
+/*
+ * Returns 1 if `format` stores pixels the same way as rgb_tiles
+ */
+int game_format_matches_tiles(Uint32 format) {
+	return format == SDL_PIXELFORMAT_ARGB8888 || format == SDL_PIXELFORMAT_RGB888;
+}
+
+/*
+ * Picks the texture format for the current renderer
+ * - accelerated: the first format the driver lists, it is uploaded without swizzling
+ * - software: the window surface format, so SDL_RenderCopy is a plain memcpy blit
+ */
+void game_query_renderer() {
+	SDL_RendererInfo info;
+	if (SDL_GetRendererInfo(renderer, &info) != 0) {
+		printf("Failed to query renderer: %s\n", SDL_GetError());
+		return;
+	}
+	game_renderer_accelerated = (info.flags & SDL_RENDERER_ACCELERATED) != 0;
+	
+	game_texture_format = SDL_PIXELFORMAT_ARGB8888;
+	if (game_renderer_accelerated) {
+		for (Uint32 i = 0; i < info.num_texture_formats; ++i) {
+			if (game_format_matches_tiles(info.texture_formats[i])) {
+				game_texture_format = info.texture_formats[i];
+				break;
+			}
+		}
+	} else if (game_format_matches_tiles(SDL_GetWindowPixelFormat(window))) {
+		game_texture_format = SDL_GetWindowPixelFormat(window);
+	}
+
+	printf("Renderer: %s (%s)\n", info.name, game_renderer_accelerated ? "accelerated" : "software");
+}
+
+/*
+ * Replaces the software renderer by one drawing into the window surface,
+ * so the compositor can write the map into the same surface
+ * Returns 0 on success, 1 if the compositor cannot be used
+ */
+int game_init_compositor() {
+	SDL_Surface *surface = SDL_GetWindowSurface(window);
+	if (surface == NULL || !game_format_matches_tiles(surface->format->format)) {
+		puts("Window surface does not match the map format, compositor disabled");
+		return 1;
+	}
+	
+	SDL_Renderer *surface_renderer = SDL_CreateSoftwareRenderer(surface);
+	if (surface_renderer == NULL) {
+		printf("Failed to create surface renderer: %s\n", SDL_GetError());
+		return 1;
+	}
+	SDL_DestroyRenderer(renderer);
+	renderer = surface_renderer;
+	game_surface = surface;
+	game_texture_format = surface->format->format;
+
+	compositor_init();
+	puts("Using software compositor");
+	return 0;
+}
+
 /*
  * Initialize SDL, subsystems and window, renderer
+ * Falls back to the software renderer if no accelerated one is available
  * Returns 0 on success, 1 on failure (prints error code)
  */
 int game_init(const char *title, const int width, const int height, Uint32 rendererflags) {
@@ -29,19 +217,41 @@ int game_init(const char *title, const int width, const int height, Uint32 rende
 		printf("SDL_mixer failed to initilaize: %s\n", Mix_GetError());
 		return 1;
 	}
+	voices_init();
 
 	window = SDL_CreateWindow(title, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, width, height, SDL_WINDOW_SHOWN);
-	renderer = SDL_CreateRenderer(window, -1, rendererflags);
-	
 	if (!window) {
 		puts("Failed to create window!");
 		return 1;
 	}
+
+	renderer = SDL_CreateRenderer(window, -1, rendererflags);
+	if (!renderer && (rendererflags & SDL_RENDERER_ACCELERATED)) {
+		printf("No accelerated renderer available (%s), falling back to software\n", SDL_GetError());
+		renderer = SDL_CreateRenderer(window, -1, (rendererflags & ~SDL_RENDERER_ACCELERATED) | SDL_RENDERER_SOFTWARE);
+	}
 	if (!renderer) {
 		puts("Failed to create renderer!");
 		return 1;
 	}
 	
+	game_query_renderer();
+	if (game_compositor && !game_renderer_accelerated)
+		game_init_compositor();
+
+	return 0;
+}
+
+/*
+ * Initialize SDL without window, renderer and audio, for servers
+ * Returns 0 on success, 1 on failure (prints error code)
+ */
+int game_init_headless() {
+	if (SDL_Init(0) < 0) {
+		printf("SDL failed to initialize: %s\n", SDL_GetError());
+		return 1;
+	}
+
 	return 0;
 }
 
@@ -59,15 +269,65 @@ int game_cleanup() {
 }
 
 /*
- * Loads an image in RGB format
+ * Decodes image `fn` to RGBA, images in game_pack are read from there
+ * Returns NULL on failure, the pixels have to be freed if `*owned` is set
  */
-Uint32 *game_load_pixels(const char *fn, unsigned int *w, unsigned int *h) {
-	unsigned char *img_rgba;
-	unsigned error = lodepng_decode32_file(&img_rgba, w, h, fn);
+const unsigned char *game_load_rgba(const char *fn, unsigned int *w, unsigned int *h, int *owned) {
+	unsigned char *img_rgba = NULL;
+	unsigned error;
+	const pack_index_t *entry = pack_find(&game_pack, fn);
+	*owned = 1;
+
+	if (entry && (entry->flags & PACK_RGBA)) {
+		/* decoded when it was packed */
+		*w = entry->width;
+		*h = entry->height;
+		*owned = 0;
+		return pack_data(&game_pack, entry);
+	} else if (entry) {
+		error = lodepng_decode32(&img_rgba, w, h, pack_data(&game_pack, entry), entry->size);
+	} else {
+		error = lodepng_decode32_file(&img_rgba, w, h, fn);
+	}
+
 	if (error) {
 		printf("Error %u loading image '%s': %s\n", error, fn, lodepng_error_text(error));
 		return NULL;
 	}
+	return img_rgba;
+}
+
+/*
+ * Loads image `fn` into a surface, images in game_pack are read from there
+ * Returns NULL on failure
+ */
+SDL_Surface *game_load_surface(const char *fn) {
+	const pack_index_t *entry = pack_find(&game_pack, fn);
+	SDL_Surface *surface;
+
+	if (entry && (entry->flags & PACK_RGBA)) {
+		/* the pixels stay in the pack, SDL only reads them */
+		surface = SDL_CreateRGBSurfaceWithFormatFrom((void *)pack_data(&game_pack, entry), entry->width, entry->height,
+			32, entry->width * 4, SDL_PIXELFORMAT_RGBA32);
+	} else if (entry) {
+		surface = IMG_Load_RW(pack_rwops(&game_pack, fn), 1);
+	} else {
+		surface = IMG_Load(fn);
+	}
+
+	if (surface == NULL)
+		printf("Unable to load image '%s': %s\n", fn, IMG_GetError());
+	return surface;
+}
+
+/*
+ * Loads an image in RGB format
+ */
+Uint32 *game_load_pixels(const char *fn, unsigned int *w, unsigned int *h) {
+	int owned;
+	const unsigned char *img_rgba = game_load_rgba(fn, w, h, &owned);
+	if (img_rgba == NULL)
+		return NULL;
 
 	Uint32 *pixels;
 	pixels = malloc(*w * *h * sizeof(Uint32));
@@ -75,7 +335,8 @@ Uint32 *game_load_pixels(const char *fn, unsigned int *w, unsigned int *h) {
 		pixels[i / 4] = RGB(img_rgba[i], img_rgba[i + 1], img_rgba[i + 2]);
 	}
 
-	free(img_rgba);
+	if (owned)
+		free((unsigned char *)img_rgba);
 	return pixels;
 }
 
@@ -83,12 +344,10 @@ Uint32 *game_load_pixels(const char *fn, unsigned int *w, unsigned int *h) {
  * Loads an image in RGB format and it's solidity-mask
  */
 Uint32 *game_load_solid_pixels(const char *fn, unsigned int *w, unsigned int *h, char *solid_tiles) {
-	unsigned char *img_rgba;
-	unsigned error = lodepng_decode32_file(&img_rgba, w, h, fn);
-	if (error) {
-		printf("Error %u loading image '%s': %s\n", error, fn, lodepng_error_text(error));
+	int owned;
+	const unsigned char *img_rgba = game_load_rgba(fn, w, h, &owned);
+	if (img_rgba == NULL)
 		return NULL;
-	}
 
 	Uint32 *pixels = malloc(*w * *h * sizeof(Uint32));
 	for (int i = 0; i < *w * *h * 4; i += 4) {
@@ -102,34 +361,142 @@ Uint32 *game_load_solid_pixels(const char *fn, unsigned int *w, unsigned int *h,
 		
 	}
 
-	free(img_rgba);
+	if (owned)
+		free((unsigned char *)img_rgba);
 	return pixels;
 }
 
 /*
- * Load texture from `fn`
+ * Returns the cached texture of `fn` with a new reference, NULL if it is not cached
+ * game_textures.lock has to be held
  */
-SDL_Texture *game_load_texture(const char *fn) {
-	SDL_Surface *surface = IMG_Load(fn);
-	/* Check if image loading worked */
-	if (surface == NULL) {
-		printf("Unable to load image '%s': %s\n", fn, IMG_GetError());
-		return NULL;
+SDL_Texture *game_find_texture(const char *fn) {
+	for (int i = 0; i < game_textures.entries_count; ++i) {
+		game_texture_entry_t *entry = &game_textures.entries[i];
+		if (!strcmp(entry->path, fn)) {
+			++entry->refs;
+			return entry->texture;
+		}
 	}
-	
-	SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, surface);
+	return NULL;
+}
+
+/*
+ * Creates the texture of `fn` from `surface` and caches it
+ * If another load of `fn` was faster its texture is used. Returns the texture with a new reference
+ */
+SDL_Texture *game_cache_texture(const char *fn, SDL_Surface *surface) {
+	SDL_AtomicLock(&game_textures.lock);
+	SDL_Texture *tex = game_find_texture(fn);
+	if (tex) {
+		SDL_AtomicUnlock(&game_textures.lock);
+		return tex;
+	}
+
+	SDL_AtomicUnlock(&game_textures.lock);
+
+	/* created without the lock, other threads keep using the cache meanwhile */
+	tex = SDL_CreateTextureFromSurface(renderer, surface);
 	/* check if surface-->texture worked */
 	if (tex == NULL) {
 		printf("Cannot create texture from surface ('%s'): %s\n", fn, SDL_GetError());
 		return NULL;
 	}
-	
+
+	SDL_AtomicLock(&game_textures.lock);
+	/* another thread created it in the meantime */
+	SDL_Texture *created = game_find_texture(fn);
+	if (created) {
+		SDL_AtomicUnlock(&game_textures.lock);
+		SDL_DestroyTexture(tex);
+		return created;
+	}
+
+	if (game_textures.entries_count == game_textures.entries_max) {
+		game_textures.entries_max = game_textures.entries_max ? game_textures.entries_max * 2 : 16;
+		game_textures.entries = realloc(game_textures.entries, game_textures.entries_max * sizeof(game_texture_entry_t));
+	}
+	game_texture_entry_t *entry = &game_textures.entries[game_textures.entries_count++];
+	entry->path = malloc(strlen(fn) + 1);
+	strcpy(entry->path, fn);
+	entry->texture = tex;
+	entry->refs = 1;
+	SDL_AtomicUnlock(&game_textures.lock);
+
+	return tex;
+}
+
+/*
+ * Load texture from `fn`
+ * Files already loaded are not loaded again, every load has to be released with game_release_texture
+ * Files requested from the streaming worker are taken from there (see stream_finish)
+ */
+SDL_Texture *game_load_texture(const char *fn) {
+	/* headless, nothing to draw to */
+	if (renderer == NULL)
+		return NULL;
+
+	SDL_AtomicLock(&game_textures.lock);
+	SDL_Texture *tex = game_find_texture(fn);
+	SDL_AtomicUnlock(&game_textures.lock);
+	if (tex)
+		return tex;
+
+	if (stream_finish(fn)) {
+		SDL_AtomicLock(&game_textures.lock);
+		tex = game_find_texture(fn);
+		SDL_AtomicUnlock(&game_textures.lock);
+		if (tex)
+			return tex;
+	}
+
+	SDL_Surface *surface = game_load_surface(fn);
+	/* Check if image loading worked */
+	if (surface == NULL)
+		return NULL;
+
+	tex = game_cache_texture(fn, surface);
 	/* clean up surface, we already have a texture */
 	SDL_FreeSurface(surface);
-
 	return tex;
 }
 
+/*
+ * Releases a texture returned by game_load_texture, it is destroyed when it is no longer used
+ * Textures that did not come from game_load_texture are destroyed right away
+ */
+void game_release_texture(SDL_Texture *tex) {
+	if (tex == NULL)
+		return;
+
+	SDL_AtomicLock(&game_textures.lock);
+	for (int i = 0; i < game_textures.entries_count; ++i) {
+		game_texture_entry_t *entry = &game_textures.entries[i];
+		if (entry->texture != tex)
+			continue;
+
+		if (--entry->refs == 0) {
+			SDL_DestroyTexture(entry->texture);
+			free(entry->path);
+			*entry = game_textures.entries[--game_textures.entries_count];
+		}
+		SDL_AtomicUnlock(&game_textures.lock);
+		return;
+	}
+	SDL_AtomicUnlock(&game_textures.lock);
+
+	SDL_DestroyTexture(tex);
+}
+
+/*
+ * Shows the rendered frame
+ */
+void game_present() {
+	SDL_RenderPresent(renderer);
+	if (game_surface)
+		SDL_UpdateWindowSurface(window);
+}
+
 /*
  * Handles events for SDL
  */
@@ -154,6 +521,27 @@ void game_get_mouse(Uint32 *mousestate, vector_t *mousepos) {
 	mousepos->y = my;
 }
 
+/*
+ * Input of one tick, sampled on the main thread
+ */
+typedef struct {
+	Uint8 keys[SDL_NUM_SCANCODES];
+	Uint32 mouse_buttons;
+	vector_t mouse;
+} game_input_t;
+
+/*
+ * Copies the current keyboard and mouse state to `input`
+ */
+void game_sample_input(game_input_t *input) {
+	int keys_count;
+	const Uint8 *keys = SDL_GetKeyboardState(&keys_count);
+	if (keys_count > SDL_NUM_SCANCODES)
+		keys_count = SDL_NUM_SCANCODES;
+	memset(input->keys, 0, sizeof(input->keys));
+	memcpy(input->keys, keys, keys_count);
+	game_get_mouse(&input->mouse_buttons, &input->mouse);
+}
 
 /*
  * Hold information to count fps
@@ -0,0 +1,226 @@
+#ifndef islands_h
+#define islands_h
+
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+/* Tiles around an edit that are searched for detached terrain, doubled up to the maximum if that is not enough */
+#define ISLANDS_MARGIN 64
+#define ISLANDS_MAX_MARGIN 512
+
+/* State of a component in islands_t::state */
+#define ISLANDS_FLOATING 0
+#define ISLANDS_ANCHORED 1
+#define ISLANDS_UNSURE 2
+#define ISLANDS_TO_PARTICLES 3
+#define ISLANDS_TO_SAND 4
+
+/*
+ * Horizontal run of solid tiles
+ */
+typedef struct {
+	int x0, x1, y;
+	/* union-find parent */
+	int parent;
+} island_run_t;
+
+/*
+ * Finds terrain cut loose by edits
+ * Solid tiles around the last edit are split into runs per row, runs touching
+ * each other are joined with union-find. Components that do not reach the border
+ * of the searched area cannot be connected to anything outside, so they float.
+ * Components reaching the bottom of the area or the sides of the map are anchored,
+ * if some only reach other borders the area is grown and searched again.
+ */
+typedef struct {
+	island_run_t *runs;
+	int runs_count, runs_max;
+	/* per root run: ISLANDS_* state and number of tiles of the component */
+	char *state;
+	int *area;
+} islands_t;
+
+/*
+ * Creates an island finder
+ */
+islands_t islands_new() {
+	islands_t islands = (islands_t) {
+		.runs = malloc(1024 * sizeof(island_run_t)),
+		.runs_count = 0,
+		.runs_max = 1024,
+		.state = malloc(1024),
+		.area = malloc(1024 * sizeof(int))
+	};
+
+	return islands;
+}
+
+/*
+ * Frees the island finder
+ */
+void islands_delete(islands_t *islands) {
+	free(islands->runs);
+	free(islands->state);
+	free(islands->area);
+}
+
+/*
+ * Returns the root run of `run`
+ */
+int islands_find(islands_t *islands, int run) {
+	while (islands->runs[run].parent != run) {
+		/* path halving */
+		islands->runs[run].parent = islands->runs[islands->runs[run].parent].parent;
+		run = islands->runs[run].parent;
+	}
+	return run;
+}
+
+/*
+ * Joins the components of runs `a` and `b`
+ */
+void islands_union(islands_t *islands, int a, int b) {
+	a = islands_find(islands, a);
+	b = islands_find(islands, b);
+	if (a == b)
+		return;
+	/* keep the older run as root */
+	if (a < b)
+		islands->runs[b].parent = a;
+	else
+		islands->runs[a].parent = b;
+}
+
+/*
+ * Appends a run, growing the buffers if needed
+ */
+void islands_add_run(islands_t *islands, int x0, int x1, int y) {
+	if (islands->runs_count == islands->runs_max) {
+		islands->runs_max *= 2;
+		islands->runs = realloc(islands->runs, islands->runs_max * sizeof(island_run_t));
+		islands->state = realloc(islands->state, islands->runs_max);
+		islands->area = realloc(islands->area, islands->runs_max * sizeof(int));
+	}
+
+	const int i = islands->runs_count++;
+	islands->runs[i] = (island_run_t) {x0, x1, y, i};
+}
+
+/*
+ * Labels the components of the area from `x0`,`y0` to `x1`,`y1`
+ * Returns the number of components that are not surely anchored or floating
+ */
+int islands_label(islands_t *islands, map_t *map, const int x0, const int y0, const int x1, const int y1) {
+	/* split rows into runs and join them with touching runs of the row above (8-connected) */
+	islands->runs_count = 0;
+	int prev_begin = 0, prev_end = 0;
+	for (int y = y0; y <= y1; ++y) {
+		const int row_begin = islands->runs_count;
+		const char *solid = &map->solid_tiles[y * map->width];
+
+		for (int x = x0; x <= x1; ++x) {
+			if (!solid[x])
+				continue;
+			const int run_x0 = x;
+			while (x <= x1 && solid[x]) {
+				++x;
+			}
+			islands_add_run(islands, run_x0, x - 1, y);
+		}
+
+		/* both rows are sorted by x, so walk them side by side */
+		int p = prev_begin;
+		for (int r = row_begin; r < islands->runs_count; ++r) {
+			while (p < prev_end && islands->runs[p].x1 < islands->runs[r].x0 - 1) {
+				++p;
+			}
+			for (int q = p; q < prev_end && islands->runs[q].x0 <= islands->runs[r].x1 + 1; ++q) {
+				islands_union(islands, q, r);
+			}
+		}
+
+		prev_begin = row_begin;
+		prev_end = islands->runs_count;
+	}
+
+	/* the top of the map has nothing to hold on to */
+	memset(islands->state, ISLANDS_FLOATING, islands->runs_count);
+	memset(islands->area, 0, islands->runs_count * sizeof(int));
+	for (int i = 0; i < islands->runs_count; ++i) {
+		island_run_t *run = &islands->runs[i];
+		const int root = islands_find(islands, i);
+		if (run->y == y1 || run->x0 == 0 || run->x1 == map->width - 1)
+			islands->state[root] = ISLANDS_ANCHORED;
+		else if ((run->x0 == x0 || run->x1 == x1 || (run->y == y0 && y0 > 0)) && islands->state[root] != ISLANDS_ANCHORED)
+			islands->state[root] = ISLANDS_UNSURE;
+		islands->area[root] += run->x1 - run->x0 + 1;
+	}
+
+	int unsure = 0;
+	for (int i = 0; i < islands->runs_count; ++i) {
+		if (islands->runs[i].parent == i && islands->state[i] == ISLANDS_UNSURE)
+			++unsure;
+	}
+	return unsure;
+}
+
+/*
+ * Searches the area edited since the last call for floating terrain and drops it
+ */
+void islands_update(islands_t *islands, map_t *map) {
+	SDL_Rect edit;
+	if (!map_take_edit(map, &edit))
+		return;
+	if (map->particles == NULL && map->sand == NULL)
+		return;
+
+	for (int margin = ISLANDS_MARGIN; ; margin *= 2) {
+		int x0 = edit.x - margin,
+		    y0 = edit.y - margin,
+		    x1 = edit.x + edit.w + margin,
+		    y1 = edit.y + edit.h + margin;
+		if (x0 < 0) x0 = 0;
+		if (y0 < 0) y0 = 0;
+		if (x1 >= map->width) x1 = map->width - 1;
+		if (y1 >= map->height) y1 = map->height - 1;
+
+		if (islands_label(islands, map, x0, y0, x1, y1) == 0 || margin >= ISLANDS_MAX_MARGIN)
+			break;
+	}
+
+	/* falling tiles keep the island's shape until it lands, so use particles while there are enough */
+	particles_t *ps = map->particles;
+	int particles_free = ps ? ps->capacity - ps->count : 0;
+	for (int i = 0; i < islands->runs_count; ++i) {
+		if (islands->runs[i].parent != i || islands->state[i] != ISLANDS_FLOATING) {
+			/* still unsure at the maximum margin */
+			if (islands->state[i] == ISLANDS_UNSURE)
+				islands->state[i] = ISLANDS_ANCHORED;
+			continue;
+		}
+
+		if (islands->area[i] <= particles_free) {
+			islands->state[i] = ISLANDS_TO_PARTICLES;
+			particles_free -= islands->area[i];
+		} else {
+			islands->state[i] = map->sand ? ISLANDS_TO_SAND : ISLANDS_ANCHORED;
+		}
+	}
+
+	for (int i = 0; i < islands->runs_count; ++i) {
+		island_run_t *run = &islands->runs[i];
+		const char state = islands->state[islands_find(islands, i)];
+
+		for (int x = run->x0; x <= run->x1 && state != ISLANDS_ANCHORED; ++x) {
+			if (state == ISLANDS_TO_PARTICLES) {
+				particles_add(ps, x, run->y, 0, 0, map_get(map, x, run->y), 600);
+				map_set_solid(map, x, run->y, 0, 0);
+			} else {
+				sand_loosen(map->sand, map, x, run->y);
+			}
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,285 @@
+#ifndef jobs_h
+#define jobs_h
+
+#include <SDL2/SDL.h>
+
+/*
+ * Job system
+ * Every worker has its own deque of jobs. Workers take jobs from the bottom of
+ * their own deque and steal from the top of the others when it runs dry.
+ * The thread calling jobs_init is worker 0 and runs jobs while it waits.
+ */
+
+#define JOBS_MAX_WORKERS 64
+#define JOBS_DEQUE_SIZE 4096
+
+/*
+ * Counts unfinished jobs, see jobs_wait
+ */
+typedef SDL_atomic_t jobs_counter_t;
+
+typedef struct {
+	/* runs the job on items [`begin`, `end`) */
+	void (*fn)(void *, int, int);
+	void *data;
+	int begin, end;
+	/* decremented when the job is done, may be NULL */
+	jobs_counter_t *counter;
+} job_t;
+
+typedef struct {
+	job_t jobs[JOBS_DEQUE_SIZE];
+	/* jobs are in [top, bottom) */
+	int top, bottom;
+	SDL_SpinLock lock;
+	SDL_threadID thread_id;
+	SDL_Thread *thread;
+} jobs_worker_t;
+
+typedef struct {
+	jobs_worker_t *workers;
+	int workers_count;
+	/* jobs in all deques, idle workers sleep until there are some */
+	SDL_atomic_t pending;
+	SDL_mutex *sleep_mutex;
+	SDL_cond *sleep_cond;
+	int running;
+} jobs_pool_t;
+
+jobs_pool_t jobs_pool = {
+	.workers = NULL,
+	.workers_count = 0
+};
+
+/*
+ * Returns the worker index of the calling thread, 0 for threads outside the pool
+ */
+int jobs_worker_index() {
+	const SDL_threadID id = SDL_ThreadID();
+	for (int i = 1; i < jobs_pool.workers_count; ++i) {
+		if (jobs_pool.workers[i].thread_id == id)
+			return i;
+	}
+	return 0;
+}
+
+/*
+ * Pushes `job` to the bottom of `worker`s deque
+ * Returns 0 if the deque is full
+ */
+int jobs_push(jobs_worker_t *worker, job_t *job) {
+	SDL_AtomicLock(&worker->lock);
+	if (worker->bottom - worker->top == JOBS_DEQUE_SIZE) {
+		SDL_AtomicUnlock(&worker->lock);
+		return 0;
+	}
+	worker->jobs[worker->bottom++ % JOBS_DEQUE_SIZE] = *job;
+	SDL_AtomicUnlock(&worker->lock);
+	return 1;
+}
+
+/*
+ * Takes a job from the bottom of `worker`s deque (own) or from the top (stealing)
+ * Returns 0 if the deque is empty
+ */
+int jobs_take(jobs_worker_t *worker, job_t *job, int steal) {
+	if (worker->bottom == worker->top)
+		return 0;
+
+	SDL_AtomicLock(&worker->lock);
+	if (worker->bottom == worker->top) {
+		SDL_AtomicUnlock(&worker->lock);
+		return 0;
+	}
+	if (steal)
+		*job = worker->jobs[worker->top++ % JOBS_DEQUE_SIZE];
+	else
+		*job = worker->jobs[--worker->bottom % JOBS_DEQUE_SIZE];
+	SDL_AtomicUnlock(&worker->lock);
+
+	SDL_AtomicAdd(&jobs_pool.pending, -1);
+	return 1;
+}
+
+/*
+ * Finds a job for worker `self`, looking at its own deque first
+ * Returns 0 if there is nothing to do
+ */
+int jobs_find(int self, job_t *job) {
+	if (jobs_take(&jobs_pool.workers[self], job, 0))
+		return 1;
+	for (int i = 1; i < jobs_pool.workers_count; ++i) {
+		if (jobs_take(&jobs_pool.workers[(self + i) % jobs_pool.workers_count], job, 1))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Runs `job` and marks it as done
+ */
+void jobs_execute(job_t *job) {
+	job->fn(job->data, job->begin, job->end);
+	if (job->counter)
+		SDL_AtomicAdd(job->counter, -1);
+}
+
+/*
+ * Main loop of the worker threads
+ */
+int jobs_worker_main(void *arg) {
+	jobs_worker_t *self = arg;
+	const int index = self - jobs_pool.workers;
+	self->thread_id = SDL_ThreadID();
+
+	job_t job;
+	while (1) {
+		if (jobs_find(index, &job)) {
+			jobs_execute(&job);
+			continue;
+		}
+
+		SDL_LockMutex(jobs_pool.sleep_mutex);
+		while (jobs_pool.running && SDL_AtomicGet(&jobs_pool.pending) == 0) {
+			SDL_CondWait(jobs_pool.sleep_cond, jobs_pool.sleep_mutex);
+		}
+		const int running = jobs_pool.running;
+		SDL_UnlockMutex(jobs_pool.sleep_mutex);
+
+		if (!running)
+			break;
+	}
+
+	return 0;
+}
+
+/*
+ * Starts the job system with `threads` workers including the calling thread
+ * Returns 0 on success
+ */
+int jobs_init(int threads) {
+	if (threads < 1)
+		threads = 1;
+	if (threads > JOBS_MAX_WORKERS)
+		threads = JOBS_MAX_WORKERS;
+
+	jobs_pool.workers = calloc(threads, sizeof(jobs_worker_t));
+	jobs_pool.workers_count = threads;
+	SDL_AtomicSet(&jobs_pool.pending, 0);
+	jobs_pool.sleep_mutex = SDL_CreateMutex();
+	jobs_pool.sleep_cond = SDL_CreateCond();
+	jobs_pool.running = 1;
+
+	jobs_pool.workers[0].thread_id = SDL_ThreadID();
+	for (int i = 1; i < threads; ++i) {
+		jobs_pool.workers[i].thread = SDL_CreateThread(&jobs_worker_main, "job worker", &jobs_pool.workers[i]);
+		if (jobs_pool.workers[i].thread == NULL) {
+			printf("Failed to create job worker: %s\n", SDL_GetError());
+			/* the remaining workers never start, their deques stay empty */
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Stops and joins all workers
+ * Jobs still queued are dropped
+ */
+void jobs_shutdown() {
+	SDL_LockMutex(jobs_pool.sleep_mutex);
+	jobs_pool.running = 0;
+	SDL_CondBroadcast(jobs_pool.sleep_cond);
+	SDL_UnlockMutex(jobs_pool.sleep_mutex);
+
+	for (int i = 1; i < jobs_pool.workers_count; ++i) {
+		if (jobs_pool.workers[i].thread)
+			SDL_WaitThread(jobs_pool.workers[i].thread, NULL);
+	}
+
+	SDL_DestroyCond(jobs_pool.sleep_cond);
+	SDL_DestroyMutex(jobs_pool.sleep_mutex);
+	free(jobs_pool.workers);
+	jobs_pool.workers = NULL;
+	jobs_pool.workers_count = 0;
+}
+
+/*
+ * Queues `count` jobs, `counter` (may be NULL) is increased by `count` and
+ * decreased whenever one of them is done
+ * Without a running pool the jobs run right away
+ */
+void jobs_run(job_t *jobs, int count, jobs_counter_t *counter) {
+	if (jobs_pool.workers_count <= 1) {
+		for (int i = 0; i < count; ++i) {
+			jobs[i].counter = NULL;
+			jobs_execute(&jobs[i]);
+		}
+		return;
+	}
+
+	if (counter)
+		SDL_AtomicAdd(counter, count);
+
+	jobs_worker_t *self = &jobs_pool.workers[jobs_worker_index()];
+	for (int i = 0; i < count; ++i) {
+		jobs[i].counter = counter;
+		SDL_AtomicAdd(&jobs_pool.pending, 1);
+		if (!jobs_push(self, &jobs[i])) {
+			/* deque is full, do it ourselves */
+			SDL_AtomicAdd(&jobs_pool.pending, -1);
+			jobs_execute(&jobs[i]);
+		}
+	}
+
+	SDL_LockMutex(jobs_pool.sleep_mutex);
+	SDL_CondBroadcast(jobs_pool.sleep_cond);
+	SDL_UnlockMutex(jobs_pool.sleep_mutex);
+}
+
+/*
+ * Runs other jobs until `counter` reaches 0
+ */
+void jobs_wait(jobs_counter_t *counter) {
+	const int self = jobs_worker_index();
+	job_t job;
+	while (SDL_AtomicGet(counter) > 0) {
+		if (jobs_find(self, &job))
+			jobs_execute(&job);
+	}
+}
+
+/*
+ * Calls `fn`(`data`, begin, end) for slices of at most `grain` items of [0, `count`)
+ * Returns when all slices are done
+ */
+void jobs_parallel_for(int count, int grain, void (*fn)(void *, int, int), void *data) {
+	if (count <= 0)
+		return;
+	if (grain < 1)
+		grain = 1;
+	if (jobs_pool.workers_count <= 1 || count <= grain) {
+		fn(data, 0, count);
+		return;
+	}
+
+	jobs_counter_t counter;
+	SDL_AtomicSet(&counter, 0);
+	job_t jobs[JOBS_MAX_WORKERS * 4];
+	const int max_jobs = sizeof(jobs) / sizeof(job_t);
+
+	/* fewer, larger slices if there are too many */
+	int slices = (count + grain - 1) / grain;
+	if (slices > max_jobs)
+		slices = max_jobs;
+	for (int i = 0; i < slices; ++i) {
+		jobs[i] = (job_t) {fn, data, (int)((long)count * i / slices), (int)((long)count * (i + 1) / slices), NULL};
+	}
+
+	/* keep the first slice for ourselves */
+	jobs_run(&jobs[1], slices - 1, &counter);
+	fn(data, jobs[0].begin, jobs[0].end);
+	jobs_wait(&counter);
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <signal.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_mixer.h>
@@ -11,12 +12,22 @@
 
 #define RGB(r,g,b) ( (r << 16) + (g << 8) + (b << 0) )
 
+#include "pack.h"
 #include "sound.h"
 #include "music.h"
 #include "atlas.h"
 #include "game.h"
+#include "jobs.h"
+#include "stream.h"
 #include "map.h"
+#include "frame.h"
+#include "delta.h"
+#include "background.h"
+#include "sand.h"
+#include "particles.h"
+#include "islands.h"
 #include "player.h"
+#include "net.h"
 
 /* Game window and renderer */
 SDL_Window *window;
@@ -26,91 +37,385 @@ int window_width  = 800,
 vector_t mouse;
 map_t level;
 
+/* Game state, owned by the simulation */
+particles_t particles;
+sand_t sand;
+islands_t islands;
+delta_t delta;
+players_t players;
+/* player controlled by keyboard and mouse, Tab switches to the next one */
+int active_player = 0;
+int switch_down = 0;
+
+/* Owned by the render thread */
+background_t background;
+fps_counter_t fps_counter;
+
+/* Multiplayer client, its socket is -1 when playing locally */
+net_client_t client = {.socket = -1};
+/* Time simulated by the client */
+Uint32 client_time;
+
+/* Cleared by SIGINT to stop the server */
+volatile sig_atomic_t server_running = 1;
+
+/*
+ * Turns keyboard and mouse state into what the player does in this tick
+ */
+player_input_t read_player_input(game_input_t *input) {
+	const Uint8 *keyboard = input->keys;
+	player_input_t command = (player_input_t) {
+		/* this calculation calculates -1 for key_left, 1 for key_right and 0 for either none or both keys down */
+		.move = (-keyboard[SDL_SCANCODE_A] | keyboard[SDL_SCANCODE_D]) * (keyboard[SDL_SCANCODE_A] ^ keyboard[SDL_SCANCODE_D]),
+		.buttons = 0,
+		.aim = vector_add(input->mouse, level.scroll)
+	};
+
+	if (keyboard[SDL_SCANCODE_W])
+		command.buttons |= PLAYER_JUMP;
+	if (input->mouse_buttons & SDL_BUTTON(SDL_BUTTON_LEFT))
+		command.buttons |= PLAYER_FIRE;
+	if (input->mouse_buttons & SDL_BUTTON(SDL_BUTTON_RIGHT))
+		command.buttons |= PLAYER_BUILD;
+
+	return command;
+}
+
+/*
+ * Advances the game by one tick and describes the result in `frame`
+ */
+void simulate(game_input_t *input, frame_t *frame) {
+	const Uint8 *keyboard = input->keys;
+	mouse = input->mouse;
+	++level.tick;
+
+	// DEBUG: Reload settings on the fly
+	if (keyboard[SDL_SCANCODE_R]) {
+		for (int i = 0; i < players.count; ++i) {
+			player_loadconfig(&players.players[i], "settings/player.js");
+		}
+	}
+
+	if (keyboard[SDL_SCANCODE_TAB] && !switch_down)
+		active_player = (active_player + 1) % players.count;
+	switch_down = keyboard[SDL_SCANCODE_TAB];
+
+	/* route keyboard and mouse to the active player, the others stand still */
+	for (int i = 0; i < players.count; ++i) {
+		players.inputs[i] = i == active_player ? read_player_input(input) : player_idle_input(&players.players[i]);
+	}
+	players_update(&players, &level);
+	player_t *player = &players.players[active_player];
+	map_apply_edits(&level);
+	islands_update(&islands, &level);
+	particles_update(&particles, &level);
+	if (level.sand)
+		sand_update(&sand, &level);
+	map_setscroll(&level, vector_sub(player->pos, vector_sdiv(vector_new(window_width, window_height), 2)));
+
+	/* Start the sounds of this tick, heard from where the camera is */
+	voices_listen(level.scroll.x, level.scroll.y, level.display_rect.w, level.display_rect.h);
+	voices_flush();
+
+	/* Describe what to draw */
+	frame_begin(frame, &level);
+	particles_capture(&particles, &level, frame);
+	players_draw(&players, &level, frame);
+}
+
+/*
+ * Runs the client side of a multiplayer game up to now in steps of a server tick
+ * and describes the result in `frame`
+ * The terrain only changes through deltas from the server.
+ */
+void simulate_client(game_input_t *input, frame_t *frame) {
+	const Uint32 now = SDL_GetTicks();
+	/* do not try to catch up after a stall */
+	if (now - client_time > 250)
+		client_time = now - NET_TICK_MS;
+
+	player_t *own = NULL;
+	while (now - client_time >= NET_TICK_MS) {
+		client_time += NET_TICK_MS;
+
+		net_client_receive(&client, &level);
+		player_input_t command = read_player_input(input);
+		net_client_send_input(&client, &level, &command);
+		own = net_client_predict(&client, &level);
+		particles_update(&particles, &level);
+		voices_listen(level.scroll.x, level.scroll.y, level.display_rect.w, level.display_rect.h);
+		voices_flush();
+	}
+	net_client_interpolate(&client);
+
+	if (own == NULL && client.slot >= 0 && client.players_loaded[client.slot])
+		own = &client.players[client.slot];
+	if (own)
+		map_setscroll(&level, vector_sub(own->pos, vector_sdiv(vector_new(window_width, window_height), 2)));
+
+	frame_begin(frame, &level);
+	particles_capture(&particles, &level, frame);
+	net_client_draw(&client, &level, frame);
+}
+
+/*
+ * Draws `frame` and shows it, has to run on the main thread
+ */
+void render(frame_t *frame) {
+	/* Clear Renderer */
+	SDL_SetRenderDrawColor(renderer, 120, 170, 220, 255);
+	SDL_RenderClear(renderer);
+	
+	/* Draw pixels */
+	frame_show_terrain(frame, &level);
+	background_render(&background, &level);
+	map_render(&level);
+	particles_render(&particles, &level, frame);
+	frame_render(frame);
+
+	/* Display FPS & Render to screen */
+	game_write_fps(&fps_counter, 10, 10);
+	game_present();
+}
+
+/*
+ * Runs the simulation until `queue` is stopped
+ */
+int simulate_thread(void *data) {
+	frame_queue_t *queue = data;
+	game_input_t input;
+	while (frame_queue_get_input(queue, &input)) {
+		if (client.socket >= 0)
+			simulate_client(&input, frame_queue_back(queue));
+		else
+			simulate(&input, frame_queue_back(queue));
+		frame_queue_submit(queue);
+	}
+	return 0;
+}
+
+void stop_server(int sig) {
+	server_running = 0;
+}
+
+/*
+ * Runs a headless, authoritative server on `port` until interrupted
+ */
+int server_main(int port) {
+	game_loadconfig("settings/game.js");
+	if (game_init_headless() != 0) {
+		return 1;
+	}
+	jobs_init(game_threads);
+
+	level = map_loadnew("maps/tiled/");
+	map_configure(&level, 0.245);
+	particles = particles_new(65536);
+	level.particles = &particles;
+	sand = sand_new(&level);
+	if (game_sand)
+		level.sand = &sand;
+	/* Record terrain edits for deltas, only the server sends them and forgets acknowledged ones */
+	delta = delta_new();
+	level.delta = &delta;
+	islands = islands_new();
+
+	net_server_t server = net_server_new(port);
+	if (server.socket < 0)
+		return 1;
+	printf("Server listening on port %d\n", port);
+	signal(SIGINT, &stop_server);
+
+	/* fixed tick rate, whatever the clients do */
+	Uint32 next_tick = SDL_GetTicks();
+	while (server_running) {
+		const Uint64 start = SDL_GetPerformanceCounter();
+		++level.tick;
+
+		net_server_receive(&server);
+		net_server_update(&server, &level);
+		map_apply_edits(&level);
+		islands_update(&islands, &level);
+		particles_update(&particles, &level);
+		if (level.sand)
+			sand_update(&sand, &level);
+		net_server_send(&server, &level, &delta);
+
+		net_server_measure(&server, SDL_GetPerformanceCounter() - start);
+
+		next_tick += NET_TICK_MS;
+		const Uint32 now = SDL_GetTicks();
+		if ((Sint32)(next_tick - now) > 0)
+			SDL_Delay(next_tick - now);
+		else
+			next_tick = now;
+	}
+
+	net_server_delete(&server);
+	particles_delete(&particles);
+	sand_delete(&sand);
+	islands_delete(&islands);
+	delta_delete(&delta);
+	map_delete(&level);
+	jobs_shutdown();
+	SDL_Quit();
+	return 0;
+}
+
+/*
+ * Usage: main [--server [port] | --client [address [port]]]
+ */
 int main(int argc, char *argv[]) {
-	if (game_init("Project ISS", window_width, window_height, SDL_RENDERER_SOFTWARE) != 0) {
+	const char *server_address = NULL;
+	int port = NET_DEFAULT_PORT;
+
+	/* Read assets from the pack if there is one, see `make pack` */
+	if (pack_open(&game_pack, PACK_FILE) == 0)
+		printf("Using asset pack '%s' (%d files)\n", PACK_FILE, game_pack.entries_count);
+
+	if (argc > 1 && !strcmp(argv[1], "--server")) {
+		const int status = server_main(argc > 2 ? atoi(argv[2]) : port);
+		pack_close(&game_pack);
+		return status;
+	}
+	if (argc > 1 && !strcmp(argv[1], "--client")) {
+		server_address = argc > 2 ? argv[2] : "127.0.0.1";
+		if (argc > 3)
+			port = atoi(argv[3]);
+	}
+
+	if (game_init("Project ISS", window_width, window_height, game_loadconfig("settings/game.js")) != 0) {
 		return 1;
 	}
 	
 	/* Init FPS Counter */
-	fps_counter_t fps_counter = game_init_fps_counter();
-	/* Mouse information*/
-	Uint32 mousestate;
-	/* Keyboard information */
-	const Uint8 *keyboard = SDL_GetKeyboardState(NULL);
+	fps_counter = game_init_fps_counter();
+
+	/* Packed sprites, loose image files are used without them */
+	if (atlas_pages_load(ATLAS_PAGES_MANIFEST) != 0)
+		printf("No sprite atlas at '%s', run `make atlas` to pack the sprites\n", ATLAS_PAGES_MANIFEST);
+	/* Keyboard and mouse state of the current tick */
+	game_input_t input;
+
+	/* Decode the players' assets while the level loads */
+	stream_init();
+	player_request_assets(STREAM_PRIORITY_HIGH);
+
+	/* Music is streamed on its own thread, it starts once the first chunks are read */
+	if (game_music_tracks_count > 0 && music_player_init() == 0) {
+		const char *tracks[GAME_MUSIC_TRACKS];
+		for (int i = 0; i < game_music_tracks_count; ++i) {
+			tracks[i] = game_music_tracks[i];
+		}
+		music_player_playlist(tracks, game_music_tracks_count, game_music_track_time * 1000);
+	}
+
+	/* Start worker threads */
+	jobs_init(game_threads);
 
 	/* Create level */
 	level = map_loadnew("maps/tiled/");
 	map_configure(&level, 0.245);
 
-	/* Create player */
-	player_t player = player_new(200, 200, 1, 1);
-	player_loadconfig(&player, "settings/player.js");
+	/* Create debris particles */
+	particles = particles_new(65536);
+	level.particles = &particles;
+
+	/* Create sand layer */
+	sand = sand_new(&level);
+	if (game_sand)
+		level.sand = &sand;
+
+	/* Create detection of detached terrain */
+	islands = islands_new();
+
+	/* Create background layers */
+	background = background_new();
+	if (game_parallax) {
+		background_add_sky(&background, RGB(120, 170, 220), RGB(200, 230, 245));
+		background_add_image(&background, "assets/Kenney/Mushroom expansion/Backgrounds/bg_grasslands.png", 0.25);
+		background_add_backdrop(&background, &level);
+		map_set_layered(&level, 1);
+	}
+
+	/* Create players */
+	players = players_new(game_players, "settings/player.js");
+	for (int i = 0; i < game_players; ++i) {
+		players_add(&players, 200 + i * 40, 200);
+	}
+
+	/* Join a server, players and terrain changes come from there */
+	if (server_address) {
+		client = net_client_new(server_address, port, &players.proto);
+		if (client.socket < 0)
+			return 1;
+		client_time = SDL_GetTicks();
+		level.sand = NULL;
+		printf("Connecting to %s:%d\n", server_address, port);
+	}
 	
+	/* Start simulation thread, the main thread only handles input and drawing */
+	frame_queue_t queue = frame_queue_new();
+	SDL_Thread *simulation = NULL;
+	if (game_render_thread) {
+		simulation = SDL_CreateThread(&simulate_thread, "simulation", &queue);
+		if (simulation == NULL)
+			printf("Failed to create simulation thread: %s\n", SDL_GetError());
+	}
+
 	/* Enter main gameloop */
 	int running = 1;
 	while (running) {
-		/**********\
-		\* UPDATE */
 		/* Handle events, update mouse information */
 		game_handle_events(&running);
-		game_get_mouse(&mousestate, &mouse);
-			
-		/* Move left/right */
-		player_move(&player, &level,
-			/* this calculation calculates -1 for key_left, 1 for key_right and 0 for either none or both keys down */
-			(-keyboard[SDL_SCANCODE_A] | keyboard[SDL_SCANCODE_D]) * (keyboard[SDL_SCANCODE_A] ^ keyboard[SDL_SCANCODE_D])
-			);
-		
-		if (keyboard[SDL_SCANCODE_W]) {
-			player_jump(&player, &level);
-		}
-		
-		// DEBUG: Reload settings on the fly
-		if (keyboard[SDL_SCANCODE_R]) {
-			player_loadconfig(&player, "settings/player.js");
-		}
+		game_sample_input(&input);
 
-		if (mousestate & SDL_BUTTON(SDL_BUTTON_LEFT)) {
-			//map_explode(&level, mouse.x + level.scroll.x, mouse.y + level.scroll.y, 25, 2, 0x313574);
-			player_grenade_new(&player);
-		}
-		if (mousestate & SDL_BUTTON(SDL_BUTTON_RIGHT)) {
-			map_set_rect(&level, mouse.x + level.scroll.x, mouse.y + level.scroll.y, 30, 14, 0x313574, 1);
-		}
-		
-		if (keyboard[SDL_SCANCODE_X]) {
-			//player_grenade_new(&player);
+		if (simulation) {
+			/* draw the last tick while the next one is simulated */
+			frame_queue_set_input(&queue, &input);
+			frame_t *frame = frame_queue_take(&queue);
+			render(frame);
+			frame_queue_release(&queue);
+		} else {
+			frame_t *frame = frame_queue_back(&queue);
+			if (client.socket >= 0)
+				simulate_client(&input, frame);
+			else
+				simulate(&input, frame);
+			render(frame);
 		}
 
-		if (player.bullets[0].rad > 1)
-			player.bullets[0].behave(&player.bullets[0], &level);
-		
-		player_update(&player, &level);
-		map_setscroll(&level, vector_sub(player.pos, vector_sdiv(vector_new(window_width, window_height), 2)));
-
+		/* Turn assets decoded in the background into textures and sounds */
+		stream_update(game_stream_budget);
+		/* Crossfade to the next track when it is time, prefetch the one after */
+		music_player_update();
 
-		/**********\
-		\* RENDER */
-		/* Clear Renderer */
-		SDL_SetRenderDrawColor(renderer, 120, 170, 220, 255);
-		SDL_RenderClear(renderer);
-		
-		/* Draw pixels */
-		map_update(&level);
-		map_render(&level);
-		player_render(&player, &level);
-
-		/* Display FPS & Render to screen */
-		game_write_fps(&fps_counter, 10, 10);
-		SDL_RenderPresent(renderer);
 		SDL_Delay(5);
 		
 		game_calculate_fps(&fps_counter);
 	}
+
+	frame_queue_stop(&queue);
+	if (simulation)
+		SDL_WaitThread(simulation, NULL);
+	frame_queue_delete(&queue);
+
+	background_delete(&background);
+	particles_delete(&particles);
+	sand_delete(&sand);
+	islands_delete(&islands);
 	map_delete(&level);
 	
-	player_delete(&player);
+	players_delete(&players);
+	if (client.socket >= 0)
+		net_client_delete(&client);
+	atlas_pages_delete();
+	music_player_shutdown();
+	stream_shutdown();
+	voices_delete();
+	jobs_shutdown();
 	
 	game_cleanup();
+	pack_close(&game_pack);
 	return 0;
 }
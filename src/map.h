@@ -3,12 +3,70 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <SDL2/SDL.h>
 
 extern SDL_Window *window;
 extern SDL_Renderer *renderer;
 extern int window_width, window_height;
 
+/* Alpha of solid tiles in rgb_tiles, non-solid tiles have no alpha */
+#define MAP_SOLID_ALPHA 0xFF000000
+
+/* The map is split into chunks of MAP_CHUNK_SIZE x MAP_CHUNK_SIZE tiles to track changes */
+#define MAP_CHUNK_SHIFT 6
+#define MAP_CHUNK_SIZE (1 << MAP_CHUNK_SHIFT)
+/* Tiles around the viewport that are uploaded before they scroll into view */
+#define MAP_UPLOAD_MARGIN 64
+
+/*
+ * Level planes cache, written next to the level images by map_loadnew
+ * Layout: map_planes_header_t, then rgb_tiles, back_rgb_tiles and solid_tiles,
+ * each starting at a multiple of MAP_PLANES_ALIGN.
+ * Maps opened from it share the file's pages read-only until they write to them,
+ * so a match only holds copies of the pages it damaged.
+ */
+#define MAP_PLANES_FILE "planes.cache"
+#define MAP_PLANES_MAGIC 0x4E4C504D /* "MPLN" */
+#define MAP_PLANES_VERSION 1
+#define MAP_PLANES_ALIGN 4096
+
+typedef struct {
+	Uint32 magic, version;
+	Uint32 width, height;
+} map_planes_header_t;
+
+struct particles_t;
+struct sand_t;
+struct delta_t;
+
+/* Kinds of map_edit_t */
+#define MAP_EDIT_CIRCLE 0
+#define MAP_EDIT_RECT 1
+#define MAP_EDIT_EXPLODE 2
+
+/*
+ * Terrain edit queued by map_edit_circle, map_edit_rect or map_explode
+ * Circles and explosions use `w` as radius, explosions `h` as width of the rim
+ */
+typedef struct {
+	int kind;
+	int x, y, w, h;
+	Uint32 c;
+	char solid;
+} map_edit_t;
+
+/*
+ * Queued edit touching a chunk, see map_apply_edits
+ */
+typedef struct {
+	int chunk, edit;
+} map_edit_ref_t;
+
 typedef struct {
 	/* full dimensions */
 	int width, height;
@@ -17,18 +75,65 @@ typedef struct {
 	
 	/* Used to draw map to screen */
 	SDL_Texture *texture;
+	/* Copy of rgb_tiles the compositor draws, only touched by the render thread */
+	Uint32 *shown_tiles;
 	/* Color tiles */
 	Uint32 *rgb_tiles;
 	/* Solid tiles */
 	char *solid_tiles;
 	/* Background tiles */
 	Uint32 *back_rgb_tiles;
+	/* mapping of the level planes cache the tiles point into, NULL if they were allocated */
+	void *planes;
+	size_t planes_size;
+	
+	/* Chunks changed since they were last passed to the renderer (see frame_capture_terrain) */
+	int chunks_w, chunks_h;
+	char *dirty_chunks;
+	/* per chunk: tick of the last change that did not go through the edit buffer, and of the last edit */
+	Uint32 *chunk_ticks;
+	Uint32 *chunk_edit_ticks;
+	/* current simulation tick */
+	Uint32 tick;
 
 	/* map properties */
 	float gravity;
+	/* draw non-solid tiles transparent over a background */
+	int layered;
+
+	/* area changed by edits since the last map_take_edit */
+	SDL_Rect edit_rect;
+	int edited;
+
+	/* edits of this tick, not applied yet */
+	map_edit_t *edits;
+	int edits_count, edits_max;
+	/* edits bucketed by chunk while they are applied */
+	map_edit_ref_t *edit_refs;
+	int edit_refs_max;
+
+	/* receives debris of explosions, NULL if disabled */
+	struct particles_t *particles;
+	/* makes explosion rims crumble, NULL if disabled */
+	struct sand_t *sand;
+	/* records applied edits, NULL if disabled */
+	struct delta_t *delta;
 } map_t;
 
-void map_update(map_t *);
+void particles_emit_explosion(struct particles_t *, map_t *, const int, const int, const int);
+void sand_loosen_circle(struct sand_t *, map_t *, const int, const int, const int);
+void delta_record(struct delta_t *, map_t *);
+
+/*
+ * (Re)creates the texture of `map`, opaque unless the map is layered
+ * The alpha channel of rgb_tiles is only opacity on layered maps
+ */
+void map_create_texture(map_t *map) {
+	if (map->texture)
+		SDL_DestroyTexture(map->texture);
+	map->texture = SDL_CreateTexture(renderer, map->layered ? SDL_PIXELFORMAT_ARGB8888 : game_texture_format, SDL_TEXTUREACCESS_STREAMING, map->width, map->height);
+	SDL_SetTextureBlendMode(map->texture, map->layered ? SDL_BLENDMODE_BLEND : SDL_BLENDMODE_NONE);
+}
 
 /*
  * Creates a new map with `width` x `height` dimensions
@@ -39,15 +144,35 @@ map_t map_new(const int width, const int height) {
 		.height = height,
 		.scroll = vector_new(0, 0),
 		.display_rect = (SDL_Rect) {0, 0, window_width, window_height},
-		.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, width, height),
+		.texture = NULL,
+		.shown_tiles = game_surface ? calloc(width * height, sizeof(Uint32)) : NULL,
 		.rgb_tiles = malloc(width * height * sizeof(Uint32)),
 		.solid_tiles = calloc(width * height, sizeof(char)),
 		.back_rgb_tiles = calloc(width * height, sizeof(Uint32)),
-		.gravity = 0.275
+		.planes = NULL,
+		.planes_size = 0,
+		.chunks_w = (width + MAP_CHUNK_SIZE - 1) >> MAP_CHUNK_SHIFT,
+		.chunks_h = (height + MAP_CHUNK_SIZE - 1) >> MAP_CHUNK_SHIFT,
+		.tick = 0,
+		.gravity = 0.275,
+		.layered = 0,
+		.edited = 0,
+		.edits = NULL,
+		.edits_count = 0,
+		.edits_max = 0,
+		.edit_refs = NULL,
+		.edit_refs_max = 0,
+		.particles = NULL,
+		.sand = NULL,
+		.delta = NULL
 	};
+	/* nothing has been uploaded yet */
+	map.dirty_chunks = malloc(map.chunks_w * map.chunks_h);
+	memset(map.dirty_chunks, 1, map.chunks_w * map.chunks_h);
+	map.chunk_ticks = calloc(map.chunks_w * map.chunks_h, sizeof(Uint32));
+	map.chunk_edit_ticks = calloc(map.chunks_w * map.chunks_h, sizeof(Uint32));
+	map_create_texture(&map);
 	
-	/* Writes rgb_tiles to texture */
-	map_update(&map);
 	return map;
 }
 
@@ -56,9 +181,19 @@ map_t map_new(const int width, const int height) {
  */
 void map_delete(map_t *map) {
 	SDL_DestroyTexture(map->texture);
-	free(map->rgb_tiles);
-	free(map->solid_tiles);
-	free(map->back_rgb_tiles);
+	free(map->shown_tiles);
+	if (map->planes) {
+		munmap(map->planes, map->planes_size);
+	} else {
+		free(map->rgb_tiles);
+		free(map->solid_tiles);
+		free(map->back_rgb_tiles);
+	}
+	free(map->dirty_chunks);
+	free(map->chunk_ticks);
+	free(map->chunk_edit_ticks);
+	free(map->edits);
+	free(map->edit_refs);
 }
 
 /*
@@ -68,6 +203,18 @@ void map_configure(map_t *map, float gravity) {
 	map->gravity = gravity;
 }
 
+/*
+ * Switches between an opaque map and one with transparent non-solid tiles
+ * that is drawn on top of a background_t
+ */
+void map_set_layered(map_t *map, int layered) {
+	map->layered = layered;
+	
+	/* transparency needs a texture with alpha */
+	map_create_texture(map);
+	memset(map->dirty_chunks, 1, map->chunks_w * map->chunks_h);
+}
+
 /*
  * Scroll `map` relative
  */
@@ -102,11 +249,21 @@ void map_setscroll(map_t *map, vector_t pos) {
 		map->scroll.y = map->height - map->display_rect.h;
 }
 
+/*
+ * Marks the chunk containing `x`,`y` for upload and as changed in this tick
+ */
+void map_mark_dirty(map_t *map, const int x, const int y) {
+	const int chunk = (x >> MAP_CHUNK_SHIFT) + (y >> MAP_CHUNK_SHIFT) * map->chunks_w;
+	map->dirty_chunks[chunk] = 1;
+	map->chunk_ticks[chunk] = map->tick;
+}
+
 /*
  * Sets tile at `x`,`y` to `c` without changing `solid` flag
  */
 void map_set(map_t *map, const int x, const int y, Uint32 c) {
 	map->rgb_tiles[x + y * map->width] = c;
+	map_mark_dirty(map, x, y);
 }
 
 /*
@@ -116,8 +273,34 @@ void map_set_solid(map_t *map, const int x, const int y, Uint32 c, const char so
 	if (!solid)
 		map->rgb_tiles[x + y * map->width] = map->back_rgb_tiles[x + y * map->width];
 	else
-		map->rgb_tiles[x + y * map->width] = c;
+		map->rgb_tiles[x + y * map->width] = c | MAP_SOLID_ALPHA;
 	map->solid_tiles[x + y * map->width] = solid;
+	map_mark_dirty(map, x, y);
+}
+
+/*
+ * Adds the area from `x0`,`y0` to `x1`,`y1` to the edited area
+ */
+void map_track_edit(map_t *map, const int x0, const int y0, const int x1, const int y1) {
+	SDL_Rect r = (SDL_Rect) {x0, y0, x1 - x0 + 1, y1 - y0 + 1};
+	if (map->edited) {
+		SDL_UnionRect(&map->edit_rect, &r, &map->edit_rect);
+	} else {
+		map->edit_rect = r;
+		map->edited = 1;
+	}
+}
+
+/*
+ * Writes the area edited since the last call to `rect`
+ * Returns 0 if nothing was edited
+ */
+int map_take_edit(map_t *map, SDL_Rect *rect) {
+	if (!map->edited)
+		return 0;
+	*rect = map->edit_rect;
+	map->edited = 0;
+	return 1;
 }
 
 /*
@@ -135,18 +318,31 @@ char map_get_solid(map_t *map, const int x, const int y) {
 }
 
 /*
- * Updates the texture by writing map::rgb_tiles to it
+ * Writes `pixels` (laid out like rgb_tiles, `pitch` bytes per row) to the area `rect` of the drawn map
+ * Has to be called on the thread owning the renderer
  */
-void map_update(map_t *map) {
-	SDL_UpdateTexture(map->texture, NULL, map->rgb_tiles, map->width * sizeof(Uint32));
+void map_upload(map_t *map, SDL_Rect *rect, const Uint32 *pixels, const int pitch) {
+	if (map->shown_tiles == NULL) {
+		SDL_UpdateTexture(map->texture, rect, pixels, pitch);
+		return;
+	}
+
+	for (int y = 0; y < rect->h; ++y) {
+		memcpy(&map->shown_tiles[rect->x + (rect->y + y) * map->width], (const Uint8 *)pixels + y * pitch, rect->w * sizeof(Uint32));
+	}
 }
 
 /*
- * Renders `map` to the screen
+ * Renders the part of `map` at display_rect to the screen
  */
 void map_render(map_t *map) {
-	map->display_rect.x = map->scroll.x;
-	map->display_rect.y = map->scroll.y;
+	if (game_surface) {
+		/* draw everything queued so far before writing to the surface */
+		SDL_RenderFlush(renderer);
+		compositor_blit(game_surface, map->shown_tiles, map->width, map->height,
+			map->display_rect.x, map->display_rect.y, map->display_rect.w, map->display_rect.h, map->layered);
+		return;
+	}
 
 	SDL_RenderCopy(renderer, map->texture, &map->display_rect, NULL);
 }
@@ -175,8 +371,10 @@ int map_in_bounds(map_t *map, const int x, const int y) {
 
 /*
  * Sets all tiles from `xp`,`yp` with a distance of `r` or lower to it to color `c` and sets its solid state to `solid`
+ * Takes effect immediately, gameplay code uses map_edit_circle
  */
 void map_set_circle(map_t *map, const int xp, const int yp, const int r, Uint32 c, int solid) {
+	map_track_edit(map, xp - r, yp - r, xp + r, yp + r);
 	for (int x = -r; x <= r; ++x) {
 		for (int y = -r; y <= r; ++y) {
 			if (x*x + y*y <= r*r && map_in_bounds(map, xp + x, yp + y)) {
@@ -189,8 +387,10 @@ void map_set_circle(map_t *map, const int xp, const int yp, const int r, Uint32
 
 /*
  * Sets all tiles from `xp - w/2`,`yp - h/2` in a dimension of `w`,`h` to it to color `c` and sets its solid state to `solid`
+ * Takes effect immediately, gameplay code uses map_edit_rect
  */
 void map_set_rect(map_t *map, const int xp, const int yp, const int w, const int h, Uint32 c, int solid) {
+	map_track_edit(map, xp - w/2, yp - h/2, xp + w/2, yp + h/2);
 	for (int x = -w/2; x < w/2; ++x) {
 		for (int y = -h/2; y < h/2; ++y) {
 			map_set_solid(map, xp + x, yp + y, c, solid);
@@ -200,19 +400,281 @@ void map_set_rect(map_t *map, const int xp, const int yp, const int w, const int
 }
 
 /*
- * Sets all tiles from `xp`,`yp` with a distance of `r` or lower to it to color `c` and sets its solid state to `solid`
+ * Appends `edit` to the edits of this tick
+ */
+void map_queue_edit(map_t *map, map_edit_t edit) {
+	if (map->edits_count == map->edits_max) {
+		map->edits_max = map->edits_max ? map->edits_max * 2 : 16;
+		map->edits = realloc(map->edits, map->edits_max * sizeof(map_edit_t));
+	}
+	map->edits[map->edits_count++] = edit;
+}
+
+/*
+ * Queues setting all tiles within `r` of `xp`,`yp` to color `c` and solid state `solid`
+ * Takes effect when map_apply_edits is called, like all map_edit_* functions
+ */
+void map_edit_circle(map_t *map, const int xp, const int yp, const int r, Uint32 c, int solid) {
+	map_queue_edit(map, (map_edit_t) {MAP_EDIT_CIRCLE, xp, yp, r, 0, c, solid});
+}
+
+/*
+ * Queues setting the `w` x `h` tiles centered on `xp`,`yp` to color `c` and solid state `solid`
+ */
+void map_edit_rect(map_t *map, const int xp, const int yp, const int w, const int h, Uint32 c, int solid) {
+	map_queue_edit(map, (map_edit_t) {MAP_EDIT_RECT, xp, yp, w, h, c, solid});
+}
+
+/*
+ * Queues an explosion at `xp`,`yp`: solid tiles within `r` get color `c`, tiles within `r` - `wd` are destroyed
  */
 void map_explode(map_t *map, const int xp, const int yp, const int r, const int wd, Uint32 c) {
-	for (int x = -r; x <= r; ++x) {
-		for (int y = -r; y <= r; ++y) {
-			if (x*x + y*y <= r*r && map_in_bounds(map, xp + x, yp + y)) {
-				if (map_get_solid(map, xp + x, yp + y))
-					map_set_solid(map, xp + x, yp + y, c, 1);
+	map_queue_edit(map, (map_edit_t) {MAP_EDIT_EXPLODE, xp, yp, r, wd, c, 0});
+}
+
+/*
+ * Writes the area covered by `edit` to `x0`,`y0`,`x1`,`y1` (inclusive)
+ */
+void map_edit_bounds(map_edit_t *edit, int *x0, int *y0, int *x1, int *y1) {
+	if (edit->kind == MAP_EDIT_RECT) {
+		*x0 = edit->x - edit->w / 2;
+		*y0 = edit->y - edit->h / 2;
+		*x1 = edit->x + edit->w / 2 - 1;
+		*y1 = edit->y + edit->h / 2 - 1;
+	} else {
+		*x0 = edit->x - edit->w;
+		*y0 = edit->y - edit->w;
+		*x1 = edit->x + edit->w;
+		*y1 = edit->y + edit->w;
+	}
+}
+
+/*
+ * Returns the largest integer whose square is at most `n`
+ */
+int map_isqrt(const int n) {
+	int s = (int)sqrtf(n);
+	while (s * s > n) {
+		--s;
+	}
+	while ((s + 1) * (s + 1) <= n) {
+		++s;
+	}
+	return s;
+}
+
+/*
+ * Writes the columns of row `dy` (relative to the center) of a disc with radius `r` to `*a`,`*b`
+ * Returns 0 if the row misses the disc
+ */
+int map_disc_row(const int r, const int dy, int *a, int *b) {
+	if (r < 0 || dy < -r || dy > r)
+		return 0;
+	const int half = map_isqrt(r * r - dy * dy);
+	*a = -half;
+	*b = half;
+	return 1;
+}
+
+/*
+ * Orders edit refs by chunk, then by queue order
+ */
+int map_edit_ref_compare(const void *a, const void *b) {
+	const map_edit_ref_t *ra = a, *rb = b;
+	if (ra->chunk != rb->chunk)
+		return ra->chunk - rb->chunk;
+	return ra->edit - rb->edit;
+}
+
+/*
+ * Shared state of map_apply_edits
+ */
+typedef struct {
+	map_t *map;
+	/* refs of chunk group g are [groups[g], groups[g + 1]) */
+	int *groups;
+} map_edit_job_t;
+
+/* State of a tile while the edits of a chunk row are merged */
+#define MAP_TILE_UNTOUCHED 0
+#define MAP_TILE_CLEARED 1
+#define MAP_TILE_FILLED 2
+#define MAP_TILE_RECOLORED 3
+
+/*
+ * Applies the edits of chunk groups [`begin`, `end`)
+ * All edits touching a row of a chunk are merged first, then every tile is written once
+ */
+void map_edit_chunks(void *data, int begin, int end) {
+	map_edit_job_t *job = data;
+	map_t *map = job->map;
+	/* per tile of a chunk row: MAP_TILE_* and the color it ends up with */
+	Uint8 state[MAP_CHUNK_SIZE];
+	Uint32 color[MAP_CHUNK_SIZE];
+
+	for (int g = begin; g < end; ++g) {
+		map_edit_ref_t *refs = &map->edit_refs[job->groups[g]];
+		const int refs_count = job->groups[g + 1] - job->groups[g];
+		const int chunk = refs[0].chunk;
+		const int x0 = (chunk % map->chunks_w) << MAP_CHUNK_SHIFT,
+		          y0 = (chunk / map->chunks_w) << MAP_CHUNK_SHIFT;
+		int x1 = x0 + MAP_CHUNK_SIZE, y1 = y0 + MAP_CHUNK_SIZE;
+		if (x1 > map->width) x1 = map->width;
+		if (y1 > map->height) y1 = map->height;
+
+		int changed = 0;
+		for (int y = y0; y < y1; ++y) {
+			/* columns touched in this row */
+			int lo = x1, hi = x0 - 1;
+			for (int k = 0; k < refs_count; ++k) {
+				map_edit_t *e = &map->edits[refs[k].edit];
+
+				int a, b;
+				if (e->kind == MAP_EDIT_RECT) {
+					if (y < e->y - e->h / 2 || y >= e->y + e->h / 2)
+						continue;
+					a = -(e->w / 2);
+					b = e->w / 2 - 1;
+				} else if (!map_disc_row(e->w, y - e->y, &a, &b)) {
+					continue;
+				}
+				a += e->x;
+				b += e->x;
+				if (a < x0) a = x0;
+				if (b >= x1) b = x1 - 1;
+				if (a > b)
+					continue;
+				if (hi < lo)
+					memset(state, MAP_TILE_UNTOUCHED, sizeof(state));
+				if (a < lo) lo = a;
+				if (b > hi) hi = b;
+
+				if (e->kind != MAP_EDIT_EXPLODE) {
+					for (int x = a; x <= b; ++x) {
+						state[x - x0] = e->solid ? MAP_TILE_FILLED : MAP_TILE_CLEARED;
+						color[x - x0] = e->c;
+					}
+					continue;
+				}
+
+				/* explosion: recolor what is still solid, then clear the crater */
+				for (int x = a; x <= b; ++x) {
+					if (state[x - x0] == MAP_TILE_CLEARED)
+						continue;
+					if (state[x - x0] == MAP_TILE_UNTOUCHED)
+						state[x - x0] = MAP_TILE_RECOLORED;
+					color[x - x0] = e->c;
+				}
+				if (!map_disc_row(e->w - e->h, y - e->y, &a, &b))
+					continue;
+				a += e->x;
+				b += e->x;
+				if (a < x0) a = x0;
+				if (b >= x1) b = x1 - 1;
+				for (int x = a; x <= b; ++x) {
+					state[x - x0] = MAP_TILE_CLEARED;
+				}
 			}
+
+			/* write the merged result */
+			for (int x = lo; x <= hi; ++x) {
+				const int i = x + y * map->width;
+				switch (state[x - x0]) {
+				case MAP_TILE_CLEARED:
+					if (!map->solid_tiles[i])
+						continue;
+					map->rgb_tiles[i] = map->back_rgb_tiles[i];
+					map->solid_tiles[i] = 0;
+					break;
+				case MAP_TILE_FILLED:
+					map->rgb_tiles[i] = color[x - x0] | MAP_SOLID_ALPHA;
+					map->solid_tiles[i] = 1;
+					break;
+				case MAP_TILE_RECOLORED:
+					if (!map->solid_tiles[i])
+						continue;
+					map->rgb_tiles[i] = color[x - x0] | MAP_SOLID_ALPHA;
+					break;
+				default:
+					continue;
+				}
+				changed = 1;
+			}
+		}
+
+		/* chunks belong to one job, so this needs no locking */
+		if (changed) {
+			map->dirty_chunks[chunk] = 1;
+			map->chunk_edit_ticks[chunk] = map->tick;
 		}
 	}
-	
-	map_set_circle(map, xp, yp, r - wd, 0x0, 0);
+}
+
+/*
+ * Applies all edits queued since the last call
+ * Edits are bucketed by chunk and the chunks are processed in parallel.
+ * The result is the same as applying them one after another.
+ */
+void map_apply_edits(map_t *map) {
+	if (map->edits_count == 0)
+		return;
+	if (map->delta)
+		delta_record(map->delta, map);
+
+	/* debris has to be emitted while the tiles are still there */
+	if (map->particles) {
+		for (int i = 0; i < map->edits_count; ++i) {
+			map_edit_t *e = &map->edits[i];
+			if (e->kind == MAP_EDIT_EXPLODE)
+				particles_emit_explosion(map->particles, map, e->x, e->y, e->w - e->h);
+		}
+	}
+
+	/* one ref per chunk touched by each edit */
+	int refs_count = 0;
+	for (int i = 0; i < map->edits_count; ++i) {
+		int x0, y0, x1, y1;
+		map_edit_bounds(&map->edits[i], &x0, &y0, &x1, &y1);
+		map_track_edit(map, x0, y0, x1, y1);
+
+		if (x0 < 0) x0 = 0;
+		if (y0 < 0) y0 = 0;
+		if (x1 >= map->width) x1 = map->width - 1;
+		if (y1 >= map->height) y1 = map->height - 1;
+		for (int cy = y0 >> MAP_CHUNK_SHIFT; cy <= y1 >> MAP_CHUNK_SHIFT; ++cy) {
+			for (int cx = x0 >> MAP_CHUNK_SHIFT; cx <= x1 >> MAP_CHUNK_SHIFT; ++cx) {
+				if (refs_count == map->edit_refs_max) {
+					map->edit_refs_max = map->edit_refs_max ? map->edit_refs_max * 2 : 64;
+					map->edit_refs = realloc(map->edit_refs, map->edit_refs_max * sizeof(map_edit_ref_t));
+				}
+				map->edit_refs[refs_count++] = (map_edit_ref_t) {cx + cy * map->chunks_w, i};
+			}
+		}
+	}
+	qsort(map->edit_refs, refs_count, sizeof(map_edit_ref_t), &map_edit_ref_compare);
+
+	/* group refs by chunk */
+	int *groups = malloc((refs_count + 1) * sizeof(int));
+	int groups_count = 0;
+	for (int i = 0; i < refs_count; ++i) {
+		if (i == 0 || map->edit_refs[i].chunk != map->edit_refs[i - 1].chunk)
+			groups[groups_count++] = i;
+	}
+	groups[groups_count] = refs_count;
+
+	map_edit_job_t job = (map_edit_job_t) {map, groups};
+	jobs_parallel_for(groups_count, 1, &map_edit_chunks, &job);
+	free(groups);
+
+	/* whatever is left of explosion rims is loose rubble */
+	if (map->sand) {
+		for (int i = 0; i < map->edits_count; ++i) {
+			map_edit_t *e = &map->edits[i];
+			if (e->kind == MAP_EDIT_EXPLODE)
+				sand_loosen_circle(map->sand, map, e->x, e->y, e->w);
+		}
+	}
+	map->edits_count = 0;
 }
 
 /*
@@ -276,8 +738,9 @@ void map_load_mask(map_t *map, const char *fn_rgb, const char *fn_mask, const ch
 	map->width = w;
 	map->height = h;
 	char *solid_pixels = malloc(map->width * map->height);
-	game_load_solid_pixels(fn_mask, &w, &h, solid_pixels);
+	free(game_load_solid_pixels(fn_mask, &w, &h, solid_pixels));
 	Uint32 *background_pixels = game_load_pixels(fn_background, &w, &h);
+	free(map->back_rgb_tiles);
 	map->back_rgb_tiles = background_pixels;
 
 	for (int x = 0; x < map->width; ++x) {
@@ -299,20 +762,17 @@ void map_load_mask(map_t *map, const char *fn_rgb, const char *fn_mask, const ch
  */
 map_t map_new_rgba(const char *fn) {
 	unsigned width, height;
-	unsigned char *img;
-	unsigned error = lodepng_decode32_file(&img, &width, &height, fn);
-	if (error) {
-		printf("error loading '%s': %s\n", fn, lodepng_error_text(error));
+	int owned;
+	const unsigned char *img = game_load_rgba(fn, &width, &height, &owned);
+	if (img == NULL)
 		exit(1);
-	}
-	free(img);
+	if (owned)
+		free((unsigned char *)img);
 	
 	map_t map = map_new(width, height);
 	
 	map_load_rgba(&map, fn);
 
-	/* Writes rgb_tiles to texture */
-	map_update(&map);
 	return map;
 }
 
@@ -321,34 +781,145 @@ map_t map_new_rgba(const char *fn) {
  */
 map_t map_new_mask(const char *fn, const char *fn_mask, const char *fn_bg) {
 	unsigned width, height;
-	unsigned char *img;
-	unsigned error = lodepng_decode32_file(&img, &width, &height, fn);
-	if (error) {
-		printf("error loading '%s': %s\n", fn, lodepng_error_text(error));
+	int owned;
+	const unsigned char *img = game_load_rgba(fn, &width, &height, &owned);
+	if (img == NULL)
 		exit(1);
-	}
-	free(img);
+	if (owned)
+		free((unsigned char *)img);
 	
 	map_t map = map_new(width, height);
 	
 	map_load_mask(&map, fn, fn_mask, fn_bg);
 
-	/* Writes rgb_tiles to texture */
-	map_update(&map);
 	return map;
 }
 
+/*
+ * Writes the offsets of the planes of a `width` x `height` map in the planes cache
+ * Returns the size of the file
+ */
+size_t map_planes_layout(const int width, const int height, size_t *rgb, size_t *back, size_t *solid) {
+	const size_t tiles = (size_t)width * height;
+	*rgb = MAP_PLANES_ALIGN;
+	*back = *rgb + (tiles * sizeof(Uint32) + MAP_PLANES_ALIGN - 1) / MAP_PLANES_ALIGN * MAP_PLANES_ALIGN;
+	*solid = *back + (tiles * sizeof(Uint32) + MAP_PLANES_ALIGN - 1) / MAP_PLANES_ALIGN * MAP_PLANES_ALIGN;
+	return *solid + tiles;
+}
+
+/*
+ * Writes the tiles of `map` to the planes cache `fn`
+ * The file is replaced at once, maps still using the old one keep their pages
+ * Returns 0 on success
+ */
+int map_save_planes(map_t *map, const char *fn) {
+	size_t rgb, back, solid;
+	map_planes_layout(map->width, map->height, &rgb, &back, &solid);
+	const size_t tiles = (size_t)map->width * map->height;
+
+	/* per process, several matches may rebuild a stale cache at once and the last rename wins */
+	char *tmp = malloc(strlen(fn) + 32);
+	sprintf(tmp, "%s.%ld.tmp", fn, (long)getpid());
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) {
+		printf("Failed to write level planes '%s'\n", tmp);
+		free(tmp);
+		return 1;
+	}
+
+	map_planes_header_t header = (map_planes_header_t) {MAP_PLANES_MAGIC, MAP_PLANES_VERSION, map->width, map->height};
+	int error = fwrite(&header, sizeof(header), 1, f) != 1;
+	error |= fseek(f, rgb, SEEK_SET) != 0 || fwrite(map->rgb_tiles, sizeof(Uint32), tiles, f) != tiles;
+	error |= fseek(f, back, SEEK_SET) != 0 || fwrite(map->back_rgb_tiles, sizeof(Uint32), tiles, f) != tiles;
+	error |= fseek(f, solid, SEEK_SET) != 0 || fwrite(map->solid_tiles, 1, tiles, f) != tiles;
+	error |= fclose(f) != 0;
+
+	if (error || rename(tmp, fn) != 0) {
+		printf("Failed to write level planes '%s'\n", fn);
+		remove(tmp);
+		free(tmp);
+		return 1;
+	}
+	free(tmp);
+	return 0;
+}
+
+/*
+ * Creates a map whose tiles are a private mapping of the planes cache `fn`
+ * Returns 0 on success
+ */
+int map_open_planes(map_t *map, const char *fn) {
+	int fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	map_planes_header_t header;
+	struct stat st;
+	if (read(fd, &header, sizeof(header)) != sizeof(header) || fstat(fd, &st) != 0
+	 || header.magic != MAP_PLANES_MAGIC || header.version != MAP_PLANES_VERSION) {
+		close(fd);
+		return 1;
+	}
+
+	size_t rgb, back, solid;
+	const size_t size = map_planes_layout(header.width, header.height, &rgb, &back, &solid);
+	if ((size_t)st.st_size != size) {
+		close(fd);
+		return 1;
+	}
+
+	/* private: writes copy the page instead of changing the file */
+	void *planes = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (planes == MAP_FAILED)
+		return 1;
+
+	*map = map_new(header.width, header.height);
+	free(map->rgb_tiles);
+	free(map->back_rgb_tiles);
+	free(map->solid_tiles);
+	map->planes = planes;
+	map->planes_size = size;
+	map->rgb_tiles = (Uint32 *)((char *)planes + rgb);
+	map->back_rgb_tiles = (Uint32 *)((char *)planes + back);
+	map->solid_tiles = (char *)planes + solid;
+
+	return 0;
+}
+
+/*
+ * Returns 1 if the planes cache `fn` is newer than all `count` images in `sources`
+ * Images in game_pack are as old as the pack
+ */
+int map_planes_fresh(const char *fn, const char **sources, const int count) {
+	struct stat cache, source;
+	if (stat(fn, &cache) != 0)
+		return 0;
+	for (int i = 0; i < count; ++i) {
+		if (pack_find(&game_pack, sources[i])) {
+			if (game_pack.mtime > cache.st_mtime)
+				return 0;
+		} else if (stat(sources[i], &source) != 0 || source.st_mtime > cache.st_mtime) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
 /*
  * Loads a map from folder by using three files
  * 1. background.png
  * 2. rgb.png
  * 3. mask.png
  * only the folder needs to be specified
+ * The decoded level is cached in MAP_PLANES_FILE in the same folder, maps of the
+ * same level share it until they change it (see map_open_planes)
  */
 map_t map_loadnew(const char *dir) {
 	char *fn_bg = calloc(strlen(dir) + 14 + 1, 1);
 	char *fn_rgb = calloc(strlen(dir) + 7 + 1, 1);
 	char *fn_mask = calloc(strlen(dir) + 8 + 1, 1);
+	char *fn_planes = calloc(strlen(dir) + strlen(MAP_PLANES_FILE) + 1, 1);
 	
 	/* build dir string */
 	strcpy(fn_bg, dir);
@@ -357,8 +928,27 @@ map_t map_loadnew(const char *dir) {
 	strcat(fn_rgb, "rgb.png");
 	strcpy(fn_mask, dir);
 	strcat(fn_mask, "mask.png");
-	
-	return map_new_mask(fn_rgb, fn_mask, fn_bg);
+	strcpy(fn_planes, dir);
+	strcat(fn_planes, MAP_PLANES_FILE);
+
+	const char *sources[] = {fn_bg, fn_rgb, fn_mask};
+	map_t map;
+	if (!map_planes_fresh(fn_planes, sources, 3) || map_open_planes(&map, fn_planes) != 0) {
+		map = map_new_mask(fn_rgb, fn_mask, fn_bg);
+
+		/* continue on the shared copy, so this match does not keep the whole level either */
+		map_t shared;
+		if (map_save_planes(&map, fn_planes) == 0 && map_open_planes(&shared, fn_planes) == 0) {
+			map_delete(&map);
+			map = shared;
+		}
+	}
+
+	free(fn_bg);
+	free(fn_rgb);
+	free(fn_mask);
+	free(fn_planes);
+	return map;
 }
 
 #endif
@@ -1,6 +1,13 @@
 #ifndef music_h
 #define music_h
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_mixer.h>
+#include "pack.h"
+
 typedef struct {
 	Mix_Music *music;
 } music_t;
@@ -9,8 +16,10 @@ typedef struct {
  * Loads a new music effect (currently only WAV)
  */
 music_t music_new(const char *fn) {
+	/* packed music is streamed from the pack's mapping */
+	SDL_RWops *rw = pack_rwops(&game_pack, fn);
 	music_t msc = (music_t) {
-		.music = Mix_LoadMUS(fn)
+		.music = rw ? Mix_LoadMUS_RW(rw, 1) : Mix_LoadMUS(fn)
 	};
 	
 	if (msc.music == NULL) {
@@ -55,5 +64,550 @@ void music_halt() {
 	Mix_HaltMusic();
 }
 
+/*
+ * Music player
+ * Streams WAV tracks instead of loading them whole. A worker thread reads and
+ * converts every track into a ring of MUSIC_RING_SIZE bytes, the mixer's music
+ * hook plays from the rings. Of the two decks one plays while the other one
+ * prefetches the next track; music_player_play switches to it with a crossfade
+ * once its ring is full, so the main thread never waits for a track to load.
+ * Tracks loop. The player replaces Mix_PlayMusic, music_t must not be played
+ * while it runs.
+ */
+#define MUSIC_DECKS 2
+#define MUSIC_RING_SIZE (256 * 1024)
+/* Bytes read from a track at once */
+#define MUSIC_READ_SIZE (16 * 1024)
+#define MUSIC_POLL_MS 10
+/* Crossfade between the tracks of a playlist */
+#define MUSIC_PLAYLIST_FADE_MS 3000
+
+typedef struct {
+	/* track of the deck, NULL for silence, `generation` changes with it */
+	char *path;
+	Uint32 generation;
+	/* generation the worker opened the track of */
+	Uint32 loaded;
+	/* the ring was filled once */
+	int ready;
+	/* mixed into the output */
+	int audible;
+	/* filled ahead by music_player_prefetch and not played yet */
+	int prefetched;
+
+	/* converted samples in [read, read + fill) wrapping at ring_size */
+	Uint8 *ring;
+	int read, fill;
+
+	/* source, only used by the worker */
+	SDL_RWops *rw;
+	SDL_AudioStream *convert;
+	Sint64 data_start, data_size, data_pos;
+} music_deck_t;
+
+typedef struct {
+	music_deck_t decks[MUSIC_DECKS];
+	/* deck playing or fading in and deck fading out, -1 if none */
+	int current, previous;
+	/* deck to switch to once it is ready, -1 if none, with a fade of `fade_frames` */
+	int next, fade_frames;
+	/* progress of the fade from `previous` to `current` */
+	int fade_pos, fade_total;
+	/* mixer format, the player only mixes AUDIO_S16SYS */
+	int frequency, channels, frame_size, ring_size;
+	/* everything above is guarded by `lock`, which the audio callback takes too */
+	SDL_SpinLock lock;
+	SDL_Thread *thread;
+	int running;
+
+	/* tracks played in turn, only used by the main thread */
+	char **playlist;
+	int playlist_count, playlist_index;
+	/* the next track is prefetched once the last crossfade ended */
+	int playlist_prefetched;
+	Uint32 playlist_ms, playlist_switch;
+} music_player_t;
+
+music_player_t game_music = {
+	.current = -1,
+	.previous = -1,
+	.next = -1,
+	.thread = NULL,
+	.running = 0,
+	.lock = 0,
+	.playlist = NULL,
+	.playlist_count = 0
+};
+
+/*
+ * Closes the track of `deck`
+ */
+void music_close_track(music_deck_t *deck) {
+	if (deck->convert)
+		SDL_FreeAudioStream(deck->convert);
+	if (deck->rw)
+		SDL_RWclose(deck->rw);
+	deck->convert = NULL;
+	deck->rw = NULL;
+}
+
+/*
+ * Opens the WAV track `fn` on `deck` and prepares converting it to the mixer format
+ * Returns 0 on success
+ */
+int music_open_track(music_deck_t *deck, const char *fn) {
+	deck->data_size = 0;
+	SDL_RWops *rw = pack_rwops(&game_pack, fn);
+	if (rw == NULL)
+		rw = SDL_RWFromFile(fn, "rb");
+	if (rw == NULL) {
+		printf("Failed to open music '%s': %s\n", fn, SDL_GetError());
+		return 1;
+	}
+
+	if (SDL_ReadLE32(rw) != 0x46464952 /* "RIFF" */ || (SDL_ReadLE32(rw), SDL_ReadLE32(rw)) != 0x45564157 /* "WAVE" */) {
+		printf("Failed to open music '%s': not a WAV file\n", fn);
+		SDL_RWclose(rw);
+		return 1;
+	}
+
+	/* find the format and the samples */
+	SDL_AudioFormat format = 0;
+	int channels = 0, frequency = 0;
+	while (1) {
+		const Uint32 id = SDL_ReadLE32(rw), size = SDL_ReadLE32(rw);
+		const Sint64 start = SDL_RWtell(rw);
+		if (id == 0 || start < 0)
+			break;
+		if (id == 0x20746D66 /* "fmt " */) {
+			const int tag = SDL_ReadLE16(rw);
+			channels = SDL_ReadLE16(rw);
+			frequency = SDL_ReadLE32(rw);
+			SDL_ReadLE32(rw);
+			SDL_ReadLE16(rw);
+			const int bits = SDL_ReadLE16(rw);
+			if (tag == 1 && bits == 8)
+				format = AUDIO_U8;
+			else if (tag == 1 && bits == 16)
+				format = AUDIO_S16LSB;
+			else if (tag == 1 && bits == 32)
+				format = AUDIO_S32LSB;
+			else if (tag == 3 && bits == 32)
+				format = AUDIO_F32LSB;
+		} else if (id == 0x61746164 /* "data" */) {
+			deck->data_start = start;
+			deck->data_size = size;
+			break;
+		}
+		/* chunks are padded to an even size */
+		SDL_RWseek(rw, start + size + (size & 1), RW_SEEK_SET);
+	}
+
+	if (format == 0 || channels < 1 || frequency < 1 || deck->data_size <= 0) {
+		printf("Failed to open music '%s': unsupported WAV format\n", fn);
+		SDL_RWclose(rw);
+		return 1;
+	}
+
+	deck->convert = SDL_NewAudioStream(format, channels, frequency, AUDIO_S16SYS, game_music.channels, game_music.frequency);
+	if (deck->convert == NULL) {
+		printf("Failed to open music '%s': %s\n", fn, SDL_GetError());
+		SDL_RWclose(rw);
+		return 1;
+	}
+	SDL_RWseek(rw, deck->data_start, RW_SEEK_SET);
+	deck->rw = rw;
+	deck->data_pos = 0;
+	return 0;
+}
+
+/*
+ * Fills the ring of `deck` with the next samples of its track, which is of `generation`
+ */
+void music_fill(music_deck_t *deck, Uint32 generation) {
+	Uint8 *chunk = malloc(MUSIC_READ_SIZE);
+	const int frame_size = game_music.frame_size;
+
+	while (1) {
+		SDL_AtomicLock(&game_music.lock);
+		const int changed = deck->generation != generation;
+		const int space = game_music.ring_size - deck->fill;
+		SDL_AtomicUnlock(&game_music.lock);
+		if (changed || space < MUSIC_READ_SIZE)
+			break;
+
+		/* convert more of the track, from the start again at its end */
+		if (SDL_AudioStreamAvailable(deck->convert) < MUSIC_READ_SIZE) {
+			Sint64 size = deck->data_size - deck->data_pos;
+			if (size > MUSIC_READ_SIZE)
+				size = MUSIC_READ_SIZE;
+			const size_t read = size > 0 ? SDL_RWread(deck->rw, chunk, 1, size) : 0;
+			if (read == 0) {
+				if (deck->data_pos == 0)
+					break;
+				SDL_RWseek(deck->rw, deck->data_start, RW_SEEK_SET);
+				deck->data_pos = 0;
+				continue;
+			}
+			deck->data_pos += read;
+			SDL_AudioStreamPut(deck->convert, chunk, read);
+			continue;
+		}
+
+		const int got = SDL_AudioStreamGet(deck->convert, chunk, MUSIC_READ_SIZE / frame_size * frame_size);
+		if (got <= 0)
+			break;
+
+		SDL_AtomicLock(&game_music.lock);
+		if (deck->generation == generation) {
+			const int write = (deck->read + deck->fill) % game_music.ring_size;
+			const int first = got < game_music.ring_size - write ? got : game_music.ring_size - write;
+			memcpy(&deck->ring[write], chunk, first);
+			memcpy(deck->ring, chunk + first, got - first);
+			deck->fill += got;
+		}
+		SDL_AtomicUnlock(&game_music.lock);
+	}
+
+	SDL_AtomicLock(&game_music.lock);
+	if (deck->generation == generation)
+		deck->ready = 1;
+	SDL_AtomicUnlock(&game_music.lock);
+	free(chunk);
+}
+
+/*
+ * Worker thread, opens the tracks of the decks and keeps their rings full
+ */
+int music_worker(void *unused) {
+	while (1) {
+		SDL_AtomicLock(&game_music.lock);
+		const int running = game_music.running;
+		SDL_AtomicUnlock(&game_music.lock);
+		if (!running)
+			break;
+
+		for (int i = 0; i < MUSIC_DECKS; ++i) {
+			music_deck_t *deck = &game_music.decks[i];
+
+			/* the deck got a new track */
+			SDL_AtomicLock(&game_music.lock);
+			const Uint32 generation = deck->generation;
+			char *path = NULL;
+			const int open = deck->loaded != generation;
+			if (open) {
+				if (deck->path) {
+					path = malloc(strlen(deck->path) + 1);
+					strcpy(path, deck->path);
+				}
+				deck->read = deck->fill = 0;
+				deck->ready = 0;
+			}
+			SDL_AtomicUnlock(&game_music.lock);
+
+			if (open) {
+				music_close_track(deck);
+				if (path)
+					music_open_track(deck, path);
+				free(path);
+				SDL_AtomicLock(&game_music.lock);
+				if (deck->generation == generation) {
+					deck->loaded = generation;
+					/* nothing to play, silence is ready right away */
+					if (deck->rw == NULL)
+						deck->ready = 1;
+				}
+				SDL_AtomicUnlock(&game_music.lock);
+			}
+
+			if (deck->rw)
+				music_fill(deck, generation);
+		}
+		SDL_Delay(MUSIC_POLL_MS);
+	}
+	return 0;
+}
+
+/*
+ * Mixes `frames` frames of `deck` into `out`, fading its volume from `from` to `to`
+ * game_music.lock has to be held
+ */
+void music_mix_deck(music_deck_t *deck, Sint16 *out, int frames, float from, float to) {
+	const int channels = game_music.channels;
+	int available = deck->fill / game_music.frame_size;
+	if (frames > available)
+		frames = available;
+
+	const float step = frames > 0 ? (to - from) / frames : 0;
+	for (int f = 0; f < frames; ++f) {
+		const Sint16 *in = (const Sint16 *)&deck->ring[deck->read];
+		const float gain = from + step * f;
+		for (int c = 0; c < channels; ++c) {
+			int sample = out[f * channels + c] + (int)(in[c] * gain);
+			if (sample > 32767)
+				sample = 32767;
+			if (sample < -32768)
+				sample = -32768;
+			out[f * channels + c] = sample;
+		}
+		deck->read = (deck->read + game_music.frame_size) % game_music.ring_size;
+	}
+	deck->fill -= frames * game_music.frame_size;
+}
+
+/*
+ * Music hook of the mixer, runs on the audio thread
+ */
+void music_mix(void *unused, Uint8 *stream, int len) {
+	memset(stream, 0, len);
+	const int frames = len / game_music.frame_size;
+
+	SDL_AtomicLock(&game_music.lock);
+	/* switch once the new track is ready, without a fade if nothing plays */
+	const int next = game_music.next;
+	if (next >= 0 && game_music.decks[next].loaded == game_music.decks[next].generation && game_music.decks[next].ready) {
+		if (game_music.previous >= 0)
+			game_music.decks[game_music.previous].audible = 0;
+		game_music.previous = game_music.current >= 0 && game_music.fade_frames > 0 ? game_music.current : -1;
+		if (game_music.current >= 0 && game_music.previous < 0)
+			game_music.decks[game_music.current].audible = 0;
+		game_music.current = next;
+		game_music.next = -1;
+		game_music.decks[next].audible = 1;
+		game_music.decks[next].prefetched = 0;
+		game_music.fade_pos = 0;
+		game_music.fade_total = game_music.previous >= 0 ? game_music.fade_frames : 0;
+	}
+
+	/* volume at the start and end of this buffer */
+	float from = 1, to = 1;
+	if (game_music.fade_total > 0) {
+		int end = game_music.fade_pos + frames;
+		if (end > game_music.fade_total)
+			end = game_music.fade_total;
+		from = (float)game_music.fade_pos / game_music.fade_total;
+		to = (float)end / game_music.fade_total;
+	}
+
+	for (int i = 0; i < MUSIC_DECKS; ++i) {
+		music_deck_t *deck = &game_music.decks[i];
+		if (!deck->audible || deck->loaded != deck->generation)
+			continue;
+		if (i == game_music.current)
+			music_mix_deck(deck, (Sint16 *)stream, frames, from, to);
+		else if (i == game_music.previous)
+			music_mix_deck(deck, (Sint16 *)stream, frames, 1 - from, 1 - to);
+	}
+
+	if (game_music.fade_total > 0) {
+		game_music.fade_pos += frames;
+		if (game_music.fade_pos >= game_music.fade_total) {
+			game_music.fade_total = 0;
+			if (game_music.previous >= 0)
+				game_music.decks[game_music.previous].audible = 0;
+			game_music.previous = -1;
+		}
+	}
+	SDL_AtomicUnlock(&game_music.lock);
+}
+
+/*
+ * Starts the music player, call after Mix_OpenAudio
+ * Returns 0 on success
+ */
+int music_player_init() {
+	int frequency, channels;
+	Uint16 format;
+	if (!Mix_QuerySpec(&frequency, &format, &channels))
+		return 1;
+	if (format != AUDIO_S16SYS) {
+		printf("Music player needs 16 bit audio\n");
+		return 1;
+	}
+
+	game_music.frequency = frequency;
+	game_music.channels = channels;
+	game_music.frame_size = channels * sizeof(Sint16);
+	game_music.ring_size = MUSIC_RING_SIZE / game_music.frame_size * game_music.frame_size;
+	for (int i = 0; i < MUSIC_DECKS; ++i) {
+		game_music.decks[i] = (music_deck_t) {
+			.path = NULL,
+			.generation = 0,
+			.loaded = 0,
+			.ready = 0,
+			.audible = 0,
+			.prefetched = 0,
+			.ring = malloc(game_music.ring_size),
+			.read = 0,
+			.fill = 0,
+			.rw = NULL,
+			.convert = NULL
+		};
+	}
+	game_music.current = game_music.previous = game_music.next = -1;
+	game_music.fade_total = 0;
+	game_music.running = 1;
+
+	game_music.thread = SDL_CreateThread(&music_worker, "music", NULL);
+	if (game_music.thread == NULL) {
+		printf("Failed to create music thread: %s\n", SDL_GetError());
+		game_music.running = 0;
+		return 1;
+	}
+	Mix_HookMusic(&music_mix, NULL);
+	return 0;
+}
+
+/*
+ * Gives `deck` the track `fn` (NULL for silence), game_music.lock has to be held
+ */
+void music_player_load(music_deck_t *deck, const char *fn) {
+	free(deck->path);
+	deck->path = NULL;
+	if (fn) {
+		deck->path = malloc(strlen(fn) + 1);
+		strcpy(deck->path, fn);
+	}
+	++deck->generation;
+	deck->ready = 0;
+	deck->audible = 0;
+	deck->prefetched = 0;
+}
+
+/*
+ * Returns the deck that neither plays nor fades out, game_music.lock has to be held
+ */
+int music_player_idle_deck() {
+	for (int i = 0; i < MUSIC_DECKS; ++i) {
+		if (i != game_music.current && i != game_music.previous)
+			return i;
+	}
+	/* both are busy with a fade, cut the fading out track short */
+	game_music.previous = -1;
+	game_music.fade_total = 0;
+	return game_music.current == 0 ? 1 : 0;
+}
+
+/*
+ * Loads `fn` ahead on the idle deck, so music_player_play of it starts right away
+ */
+void music_player_prefetch(const char *fn) {
+	if (!game_music.running)
+		return;
+	SDL_AtomicLock(&game_music.lock);
+	music_deck_t *deck = &game_music.decks[music_player_idle_deck()];
+	if (!deck->prefetched || !deck->path || strcmp(deck->path, fn)) {
+		music_player_load(deck, fn);
+		deck->prefetched = 1;
+	}
+	SDL_AtomicUnlock(&game_music.lock);
+}
+
+/*
+ * Switches to track `fn` (NULL stops the music), crossfading over `fade_ms` milliseconds
+ * The switch happens once the track is loaded, unless it was prefetched
+ */
+void music_player_play(const char *fn, int fade_ms) {
+	if (!game_music.running)
+		return;
+	SDL_AtomicLock(&game_music.lock);
+	const int i = music_player_idle_deck();
+	music_deck_t *deck = &game_music.decks[i];
+	const int prefetched = deck->prefetched && fn && deck->path && !strcmp(deck->path, fn);
+	if (!prefetched)
+		music_player_load(deck, fn);
+	game_music.next = i;
+	game_music.fade_frames = (Sint64)fade_ms * game_music.frequency / 1000;
+	SDL_AtomicUnlock(&game_music.lock);
+}
+
+/*
+ * Fades the music out over `fade_ms` milliseconds
+ */
+void music_player_stop(int fade_ms) {
+	music_player_play(NULL, fade_ms);
+}
+
+/*
+ * Plays `count` `tracks` in turn, each for `track_ms` milliseconds, starting with the first one
+ * The next track is prefetched while the current one plays, see music_player_update
+ */
+void music_player_playlist(const char **tracks, int count, Uint32 track_ms) {
+	if (!game_music.running || count < 1)
+		return;
+	for (int i = 0; i < game_music.playlist_count; ++i) {
+		free(game_music.playlist[i]);
+	}
+	game_music.playlist = realloc(game_music.playlist, count * sizeof(char *));
+	for (int i = 0; i < count; ++i) {
+		game_music.playlist[i] = malloc(strlen(tracks[i]) + 1);
+		strcpy(game_music.playlist[i], tracks[i]);
+	}
+	game_music.playlist_count = count;
+	game_music.playlist_index = 0;
+	game_music.playlist_prefetched = 0;
+	game_music.playlist_ms = track_ms;
+	game_music.playlist_switch = SDL_GetTicks() + track_ms;
+	music_player_play(game_music.playlist[0], 0);
+}
+
+/*
+ * Advances the playlist, call once per frame
+ */
+void music_player_update() {
+	if (!game_music.running || game_music.playlist_count < 2)
+		return;
+
+	const int next = (game_music.playlist_index + 1) % game_music.playlist_count;
+	if ((Sint32)(SDL_GetTicks() - game_music.playlist_switch) >= 0) {
+		music_player_play(game_music.playlist[next], MUSIC_PLAYLIST_FADE_MS);
+		game_music.playlist_index = next;
+		game_music.playlist_prefetched = 0;
+		game_music.playlist_switch = SDL_GetTicks() + game_music.playlist_ms;
+		return;
+	}
+
+	/* the idle deck is the one fading out until the crossfade is over */
+	if (!game_music.playlist_prefetched) {
+		SDL_AtomicLock(&game_music.lock);
+		const int busy = game_music.next >= 0 || game_music.previous >= 0;
+		SDL_AtomicUnlock(&game_music.lock);
+		if (!busy) {
+			music_player_prefetch(game_music.playlist[next]);
+			game_music.playlist_prefetched = 1;
+		}
+	}
+}
+
+/*
+ * Stops the music player
+ */
+void music_player_shutdown() {
+	if (!game_music.running)
+		return;
+	Mix_HookMusic(NULL, NULL);
+
+	SDL_AtomicLock(&game_music.lock);
+	game_music.running = 0;
+	SDL_AtomicUnlock(&game_music.lock);
+	SDL_WaitThread(game_music.thread, NULL);
+	game_music.thread = NULL;
+
+	for (int i = 0; i < MUSIC_DECKS; ++i) {
+		music_close_track(&game_music.decks[i]);
+		free(game_music.decks[i].ring);
+		free(game_music.decks[i].path);
+		game_music.decks[i].ring = NULL;
+		game_music.decks[i].path = NULL;
+	}
+	game_music.current = game_music.previous = game_music.next = -1;
+
+	for (int i = 0; i < game_music.playlist_count; ++i) {
+		free(game_music.playlist[i]);
+	}
+	free(game_music.playlist);
+	game_music.playlist = NULL;
+	game_music.playlist_count = 0;
+}
 
 #endif
@@ -0,0 +1,878 @@
+#ifndef net_h
+#define net_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <SDL2/SDL.h>
+#include "vector.h"
+
+/*
+ * Client/server multiplayer over UDP
+ * The server is authoritative: it runs the simulation at a fixed tick rate,
+ * applies the latest input of every client and sends each client a snapshot of
+ * all players per tick, delta coded against the last snapshot the client
+ * acknowledged. Terrain changes are sent as terrain deltas (see delta.h) since
+ * the last tick the client acknowledged, split into fragments.
+ * Clients predict their own movement by replaying the inputs the server has not
+ * applied yet on top of the latest snapshot and show everybody else
+ * NET_INTERP_TICKS in the past, interpolated between snapshots.
+ *
+ * Packets, all numbers little-endian:
+ *   input:    u8 type, u32 seq, u32 snapshot ack, u32 terrain ack, i8 move, u8 buttons, f32 aim x, f32 aim y
+ *   snapshot: u8 type, u32 tick, u32 baseline tick (0 for none), u32 input ack, u8 slot, u16 players present,
+ *             per present player: u8 changed fields, the changed fields
+ *   terrain:  u8 type, u32 from tick, u32 to tick, u16 fragment, u16 fragments, payload
+ */
+
+#define NET_DEFAULT_PORT 7777
+#define NET_MAX_PLAYERS 16
+/* Length of a tick of the server simulation */
+#define NET_TICK_MS 16
+/* Snapshots and inputs kept for deltas, prediction and interpolation, a power of two */
+#define NET_HISTORY 64
+/* Remote players are shown this many ticks in the past */
+#define NET_INTERP_TICKS 6
+/* Terrain delta bytes per packet, keeps packets below the usual MTU */
+#define NET_FRAGMENT_SIZE 1200
+#define NET_MAX_PACKET 1500
+/* Clients not heard from for this long are dropped */
+#define NET_TIMEOUT 5000
+/* Terrain fragments sent to a client per tick, larger deltas take several ticks */
+#define NET_FRAGMENTS_PER_TICK 64
+/* Terrain deltas not acknowledged after this long are sent again */
+#define NET_RESEND_MS 250
+/* Interval of the server statistics */
+#define NET_STATS_MS 5000
+
+/* Packet types */
+#define NET_INPUT 1
+#define NET_SNAPSHOT 2
+#define NET_TERRAIN 3
+
+/* Fields of net_player_state_t in the changed fields mask */
+#define NET_FIELD_FLAGS 1
+#define NET_FIELD_POS 2
+#define NET_FIELD_VEL 4
+#define NET_FIELD_AIM 8
+#define NET_FIELD_BULLET_POS 16
+#define NET_FIELD_BULLET_VEL 32
+#define NET_FIELD_ALL 63
+
+/*
+ * Part of a player that is sent to clients
+ */
+typedef struct {
+	Uint8 present;
+	/* NET_FIELD_FLAGS */
+	Sint8 walk_dir;
+	Uint8 bullet_active;
+	vector_t pos, vel, aim_dir;
+	vector_t bullet_pos, bullet_vel;
+} net_player_state_t;
+
+/*
+ * All players in one tick
+ */
+typedef struct {
+	Uint32 tick;
+	/* newest input of the receiving client applied in this tick, only used by clients */
+	Uint32 input_ack;
+	net_player_state_t players[NET_MAX_PLAYERS];
+} net_snapshot_t;
+
+/*
+ * Client as seen by the server
+ */
+typedef struct {
+	int used;
+	struct sockaddr_in addr;
+	Uint32 last_heard;
+	player_t player;
+
+	/* latest input and its sequence number */
+	player_input_t input;
+	Uint32 input_seq;
+	/* newest snapshot and terrain tick the client has */
+	Uint32 snapshot_ack, terrain_ack;
+
+	/* terrain delta being sent, NULL if none */
+	Uint8 *terrain;
+	int terrain_size, terrain_next;
+	Uint32 terrain_from, terrain_to;
+	/* tick the last delta went to and when it was sent completely */
+	Uint32 terrain_sent, terrain_sent_time;
+
+	/* since the last statistics */
+	Uint32 bytes_sent, bytes_received;
+} net_peer_t;
+
+typedef struct {
+	int socket;
+	net_peer_t peers[NET_MAX_PLAYERS];
+	net_snapshot_t snapshots[NET_HISTORY];
+	delta_writer_t packet;
+
+	/* statistics */
+	Uint32 stats_time;
+	Uint64 stats_busy;
+	int stats_ticks;
+} net_server_t;
+
+typedef struct {
+	int socket;
+	struct sockaddr_in server;
+	delta_writer_t packet;
+
+	/* slot of our player, -1 until the first snapshot */
+	int slot;
+	net_snapshot_t snapshots[NET_HISTORY];
+	/* newest snapshot and when it arrived, 0 if none */
+	Uint32 latest, latest_time;
+
+	/* inputs sent, by sequence number */
+	player_input_t inputs[NET_HISTORY];
+	Uint32 input_seq;
+
+	/* terrain delta being reassembled */
+	Uint8 *terrain;
+	char *fragments;
+	Uint32 terrain_from, terrain_to;
+	int terrain_count, terrain_received, terrain_size;
+
+	/* players as shown, copied from `proto` when they first appear */
+	const player_t *proto;
+	player_t players[NET_MAX_PLAYERS];
+	char players_loaded[NET_MAX_PLAYERS];
+} net_client_t;
+
+/*
+ * Opens a non-blocking UDP socket bound to `port`, 0 for any port
+ * Returns -1 on failure
+ */
+int net_open(int port) {
+	int s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s < 0) {
+		printf("Failed to create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		printf("Failed to bind port %d: %s\n", port, strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+	return s;
+}
+
+/*
+ * Appends a float
+ */
+void net_put_float(delta_writer_t *w, float f) {
+	Uint32 bits;
+	memcpy(&bits, &f, sizeof(bits));
+	delta_put(w, bits, 4);
+}
+
+/*
+ * Reads a float
+ */
+float net_get_float(delta_reader_t *r) {
+	const Uint32 bits = delta_get(r, 4);
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+void net_put_vector(delta_writer_t *w, vector_t v) {
+	net_put_float(w, v.x);
+	net_put_float(w, v.y);
+}
+
+vector_t net_get_vector(delta_reader_t *r) {
+	const float x = net_get_float(r);
+	return vector_new(x, net_get_float(r));
+}
+
+/*
+ * Returns 1 if `a` and `b` are exactly the same
+ */
+int net_vector_equal(vector_t a, vector_t b) {
+	return a.x == b.x && a.y == b.y;
+}
+
+/*
+ * Returns the NET_FIELD_* mask of fields that differ between `a` and `b`
+ */
+Uint8 net_player_changes(net_player_state_t *a, net_player_state_t *b) {
+	Uint8 mask = 0;
+	if (a->walk_dir != b->walk_dir || a->bullet_active != b->bullet_active)
+		mask |= NET_FIELD_FLAGS;
+	if (!net_vector_equal(a->pos, b->pos))
+		mask |= NET_FIELD_POS;
+	if (!net_vector_equal(a->vel, b->vel))
+		mask |= NET_FIELD_VEL;
+	if (!net_vector_equal(a->aim_dir, b->aim_dir))
+		mask |= NET_FIELD_AIM;
+	if (!net_vector_equal(a->bullet_pos, b->bullet_pos))
+		mask |= NET_FIELD_BULLET_POS;
+	if (!net_vector_equal(a->bullet_vel, b->bullet_vel))
+		mask |= NET_FIELD_BULLET_VEL;
+	return mask;
+}
+
+/*
+ * Appends the players of `snapshot`, only fields that changed since `base` (may be NULL)
+ */
+void net_put_snapshot(delta_writer_t *w, net_snapshot_t *snapshot, net_snapshot_t *base) {
+	Uint16 present = 0;
+	for (int i = 0; i < NET_MAX_PLAYERS; ++i) {
+		if (snapshot->players[i].present)
+			present |= 1 << i;
+	}
+	delta_put(w, present, 2);
+
+	for (int i = 0; i < NET_MAX_PLAYERS; ++i) {
+		net_player_state_t *p = &snapshot->players[i];
+		if (!p->present)
+			continue;
+
+		const Uint8 mask = base && base->players[i].present ? net_player_changes(p, &base->players[i]) : NET_FIELD_ALL;
+		delta_put(w, mask, 1);
+		if (mask & NET_FIELD_FLAGS) {
+			delta_put(w, (Uint8)p->walk_dir, 1);
+			delta_put(w, p->bullet_active, 1);
+		}
+		if (mask & NET_FIELD_POS) net_put_vector(w, p->pos);
+		if (mask & NET_FIELD_VEL) net_put_vector(w, p->vel);
+		if (mask & NET_FIELD_AIM) net_put_vector(w, p->aim_dir);
+		if (mask & NET_FIELD_BULLET_POS) net_put_vector(w, p->bullet_pos);
+		if (mask & NET_FIELD_BULLET_VEL) net_put_vector(w, p->bullet_vel);
+	}
+}
+
+/*
+ * Reads players written by net_put_snapshot into `snapshot`, using the same `base`
+ */
+void net_get_snapshot(delta_reader_t *r, net_snapshot_t *snapshot, net_snapshot_t *base) {
+	const Uint16 present = delta_get(r, 2);
+
+	for (int i = 0; i < NET_MAX_PLAYERS; ++i) {
+		net_player_state_t *p = &snapshot->players[i];
+		if (!(present & (1 << i))) {
+			memset(p, 0, sizeof(net_player_state_t));
+			continue;
+		}
+
+		if (base && base->players[i].present)
+			*p = base->players[i];
+		else
+			memset(p, 0, sizeof(net_player_state_t));
+		p->present = 1;
+
+		const Uint8 mask = delta_get(r, 1);
+		if (mask & NET_FIELD_FLAGS) {
+			p->walk_dir = (Sint8)delta_get(r, 1);
+			p->bullet_active = delta_get(r, 1);
+		}
+		if (mask & NET_FIELD_POS) p->pos = net_get_vector(r);
+		if (mask & NET_FIELD_VEL) p->vel = net_get_vector(r);
+		if (mask & NET_FIELD_AIM) p->aim_dir = net_get_vector(r);
+		if (mask & NET_FIELD_BULLET_POS) p->bullet_pos = net_get_vector(r);
+		if (mask & NET_FIELD_BULLET_VEL) p->bullet_vel = net_get_vector(r);
+	}
+}
+
+/*
+ * Stores what clients see of `player` in `state`
+ */
+void net_capture_player(net_player_state_t *state, player_t *player) {
+	*state = (net_player_state_t) {
+		.present = 1,
+		.walk_dir = player->walk_dir,
+		.bullet_active = player->bullets[0].active,
+		.pos = player->pos,
+		.vel = player->vel,
+		.aim_dir = player->aim_dir,
+		.bullet_pos = player->bullets[0].pos,
+		.bullet_vel = player->bullets[0].vel
+	};
+}
+
+/*
+ * Sets `player` to `state`
+ */
+void net_restore_player(player_t *player, net_player_state_t *state) {
+	player->walk_dir = state->walk_dir;
+	player->pos = state->pos;
+	player->vel = state->vel;
+	player->aim_dir = state->aim_dir;
+	player->bullets[0].active = state->bullet_active;
+	player->bullets[0].pos = state->bullet_pos;
+	player->bullets[0].vel = state->bullet_vel;
+}
+
+/*
+ * Sends the packet in `w` to `addr`
+ * Returns the number of bytes sent
+ */
+int net_send(int s, delta_writer_t *w, struct sockaddr_in *addr) {
+	const int sent = sendto(s, w->data, w->size, 0, (struct sockaddr *)addr, sizeof(*addr));
+	return sent > 0 ? sent : 0;
+}
+
+/*
+ * Starts a server on `port`, its socket is -1 on failure
+ */
+net_server_t net_server_new(int port) {
+	net_server_t server;
+	memset(&server, 0, sizeof(server));
+	server.socket = net_open(port);
+	server.stats_time = SDL_GetTicks();
+
+	return server;
+}
+
+/*
+ * Removes the client in `slot`
+ */
+void net_server_drop(net_server_t *server, int slot) {
+	net_peer_t *peer = &server->peers[slot];
+	player_delete(&peer->player);
+	free(peer->terrain);
+	peer->used = 0;
+}
+
+/*
+ * Closes the server and removes all players
+ */
+void net_server_delete(net_server_t *server) {
+	for (int i = 0; i < NET_MAX_PLAYERS; ++i) {
+		if (server->peers[i].used)
+			net_server_drop(server, i);
+	}
+	free(server->packet.data);
+	if (server->socket >= 0)
+		close(server->socket);
+}
+
+/*
+ * Returns the peer sending from `addr`, adding it if it is new
+ * Returns NULL if the server is full
+ */
+net_peer_t *net_server_peer(net_server_t *server, struct sockaddr_in *addr) {
+	int free_slot = -1;
+	for (int i = 0; i < NET_MAX_PLAYERS; ++i) {
+		net_peer_t *peer = &server->peers[i];
+		if (!peer->used) {
+			if (free_slot < 0)
+				free_slot = i;
+			continue;
+		}
+		if (peer->addr.sin_addr.s_addr == addr->sin_addr.s_addr && peer->addr.sin_port == addr->sin_port)
+			return peer;
+	}
+	if (free_slot < 0)
+		return NULL;
+
+	net_peer_t *peer = &server->peers[free_slot];
+	memset(peer, 0, sizeof(net_peer_t));
+	peer->used = 1;
+	peer->addr = *addr;
+	peer->player = player_new(200 + free_slot * 40, 200, 1, 1);
+	player_loadconfig(&peer->player, "settings/player.js");
+	printf("Client %d joined from %s:%d\n", free_slot, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+
+	return peer;
+}
+
+/*
+ * Reads all pending input packets and drops clients that went silent
+ */
+void net_server_receive(net_server_t *server) {
+	Uint8 data[NET_MAX_PACKET];
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	int size;
+	const Uint32 now = SDL_GetTicks();
+
+	while ((size = recvfrom(server->socket, data, sizeof(data), 0, (struct sockaddr *)&addr, &addr_len)) > 0) {
+		delta_reader_t r = (delta_reader_t) {data, size, 0, 0};
+		if (delta_get(&r, 1) != NET_INPUT)
+			continue;
+
+		const Uint32 seq = delta_get(&r, 4),
+		             snapshot_ack = delta_get(&r, 4),
+		             terrain_ack = delta_get(&r, 4);
+		player_input_t input;
+		input.move = (Sint8)delta_get(&r, 1);
+		input.buttons = delta_get(&r, 1);
+		input.aim = net_get_vector(&r);
+		if (r.error)
+			continue;
+
+		net_peer_t *peer = net_server_peer(server, &addr);
+		if (peer == NULL)
+			continue;
+		peer->last_heard = now;
+		peer->bytes_received += size;
+
+		/* packets may arrive out of order */
+		if (seq > peer->input_seq) {
+			peer->input_seq = seq;
+			peer->input = input;
+		}
+		if (snapshot_ack > peer->snapshot_ack)
+			peer->snapshot_ack = snapshot_ack;
+		if (terrain_ack > peer->terrain_ack)
+			peer->terrain_ack = terrain_ack;
+	}
+
+	for (int i = 0; i < NET_MAX_PLAYERS; ++i) {
+		net_peer_t *peer = &server->peers[i];
+		if (peer->used && now - peer->last_heard > NET_TIMEOUT) {
+			printf("Client %d timed out\n", i);
+			net_server_drop(server, i);
+		}
+	}
+}
+
+/*
+ * Applies the latest input of every client and moves their players
+ */
+void net_server_update(net_server_t *server, map_t *map) {
+	for (int i = 0; i < NET_MAX_PLAYERS; ++i) {
+		net_peer_t *peer = &server->peers[i];
+		if (!peer->used)
+			continue;
+
+		player_apply_input(&peer->player, map, &peer->input);
+		player_update_bullets(&peer->player, map);
+		player_update(&peer->player, map);
+	}
+}
+
+/*
+ * Sends the terrain changes `peer` is missing in fragments
+ * A new delta is only made once the last one was acknowledged or got lost,
+ * so the client can finish reassembling it
+ */
+void net_server_send_terrain(net_server_t *server, net_peer_t *peer, map_t *map, delta_t *delta) {
+	const Uint32 now = SDL_GetTicks();
+	if (peer->terrain == NULL) {
+		if (peer->terrain_ack >= map->tick)
+			return;
+		if (peer->terrain_ack < peer->terrain_sent && now - peer->terrain_sent_time < NET_RESEND_MS)
+			return;
+		peer->terrain = delta_encode(delta, map, peer->terrain_ack, &peer->terrain_size);
+		peer->terrain_next = 0;
+		peer->terrain_from = peer->terrain_ack;
+		peer->terrain_to = map->tick;
+	}
+
+	const int fragments = (peer->terrain_size + NET_FRAGMENT_SIZE - 1) / NET_FRAGMENT_SIZE;
+	delta_writer_t *w = &server->packet;
+	for (int sent = 0; sent < NET_FRAGMENTS_PER_TICK && peer->terrain_next < fragments; ++sent) {
+		const int i = peer->terrain_next++;
+		const int offset = i * NET_FRAGMENT_SIZE,
+		          length = peer->terrain_size - offset < NET_FRAGMENT_SIZE ? peer->terrain_size - offset : NET_FRAGMENT_SIZE;
+		w->size = 0;
+		delta_put(w, NET_TERRAIN, 1);
+		delta_put(w, peer->terrain_from, 4);
+		delta_put(w, peer->terrain_to, 4);
+		delta_put(w, i, 2);
+		delta_put(w, fragments, 2);
+		for (int j = 0; j < length; ++j) {
+			delta_put(w, peer->terrain[offset + j], 1);
+		}
+		peer->bytes_sent += net_send(server->socket, w, &peer->addr);
+	}
+
+	if (peer->terrain_next == fragments) {
+		free(peer->terrain);
+		peer->terrain = NULL;
+		peer->terrain_sent = peer->terrain_to;
+		peer->terrain_sent_time = now;
+	}
+}
+
+/*
+ * Sends every client a snapshot of the current tick and the terrain it is missing
+ */
+void net_server_send(net_server_t *server, map_t *map, delta_t *delta) {
+	net_snapshot_t *snapshot = &server->snapshots[map->tick % NET_HISTORY];
+	snapshot->tick = map->tick;
+	for (int i = 0; i < NET_MAX_PLAYERS; ++i) {
+		if (server->peers[i].used)
+			net_capture_player(&snapshot->players[i], &server->peers[i].player);
+		else
+			memset(&snapshot->players[i], 0, sizeof(net_player_state_t));
+	}
+
+	/* oldest terrain any client still needs a delta from */
+	Uint32 oldest = map->tick;
+	for (int i = 0; i < NET_MAX_PLAYERS; ++i) {
+		net_peer_t *peer = &server->peers[i];
+		if (!peer->used)
+			continue;
+
+		/* delta against the acknowledged snapshot, if it is still in the history */
+		net_snapshot_t *base = &server->snapshots[peer->snapshot_ack % NET_HISTORY];
+		if (peer->snapshot_ack == 0 || base->tick != peer->snapshot_ack)
+			base = NULL;
+
+		delta_writer_t *w = &server->packet;
+		w->size = 0;
+		delta_put(w, NET_SNAPSHOT, 1);
+		delta_put(w, snapshot->tick, 4);
+		delta_put(w, base ? base->tick : 0, 4);
+		delta_put(w, peer->input_seq, 4);
+		delta_put(w, i, 1);
+		net_put_snapshot(w, snapshot, base);
+		peer->bytes_sent += net_send(server->socket, w, &peer->addr);
+
+		net_server_send_terrain(server, peer, map, delta);
+		if (peer->terrain_ack < oldest)
+			oldest = peer->terrain_ack;
+	}
+
+	delta_forget(delta, oldest);
+}
+
+/*
+ * Adds `busy` performance counter ticks spent on a tick to the statistics
+ * Prints CPU time and bandwidth per client every NET_STATS_MS
+ */
+void net_server_measure(net_server_t *server, Uint64 busy) {
+	server->stats_busy += busy;
+	++server->stats_ticks;
+
+	const Uint32 now = SDL_GetTicks();
+	const Uint32 elapsed = now - server->stats_time;
+	if (elapsed < NET_STATS_MS)
+		return;
+
+	int clients = 0;
+	Uint32 sent = 0, received = 0;
+	for (int i = 0; i < NET_MAX_PLAYERS; ++i) {
+		net_peer_t *peer = &server->peers[i];
+		if (!peer->used)
+			continue;
+		++clients;
+		sent += peer->bytes_sent;
+		received += peer->bytes_received;
+		peer->bytes_sent = 0;
+		peer->bytes_received = 0;
+	}
+
+	const double tick_ms = server->stats_busy * 1000.0 / SDL_GetPerformanceFrequency() / server->stats_ticks;
+	printf("Server: %d clients, %.3f ms per tick", clients, tick_ms);
+	if (clients > 0) {
+		printf(", per client %.3f ms per tick, %.1f KB/s down, %.1f KB/s up",
+			tick_ms / clients,
+			sent / 1024.0 / clients * 1000.0 / elapsed,
+			received / 1024.0 / clients * 1000.0 / elapsed);
+	}
+	printf("\n");
+
+	server->stats_time = now;
+	server->stats_busy = 0;
+	server->stats_ticks = 0;
+}
+
+/*
+ * Creates a client of the server at `host`:`port`, its socket is -1 on failure
+ * Players it shows share the textures, sounds and settings of `proto`, which has to outlive the client
+ */
+net_client_t net_client_new(const char *host, int port, const player_t *proto) {
+	net_client_t client;
+	memset(&client, 0, sizeof(client));
+	client.slot = -1;
+	client.proto = proto;
+	client.socket = net_open(0);
+
+	memset(&client.server, 0, sizeof(client.server));
+	client.server.sin_family = AF_INET;
+	client.server.sin_port = htons(port);
+	client.server.sin_addr.s_addr = inet_addr(host);
+	if (client.server.sin_addr.s_addr == INADDR_NONE) {
+		printf("Invalid server address '%s'\n", host);
+		if (client.socket >= 0)
+			close(client.socket);
+		client.socket = -1;
+	}
+
+	return client;
+}
+
+/*
+ * Closes the client and frees the players it shows
+ */
+void net_client_delete(net_client_t *client) {
+	for (int i = 0; i < NET_MAX_PLAYERS; ++i) {
+		if (!client->players_loaded[i])
+			continue;
+		bullet_delete(&client->players[i].bullets[0]);
+		free(client->players[i].bullets);
+	}
+	free(client->packet.data);
+	free(client->terrain);
+	free(client->fragments);
+	if (client->socket >= 0)
+		close(client->socket);
+}
+
+/*
+ * Returns the player shown for `slot`, copied from the prototype on first use like players_add does
+ * Runs on the simulation thread, so nothing is loaded here
+ */
+player_t *net_client_player(net_client_t *client, int slot) {
+	if (!client->players_loaded[slot]) {
+		player_t *p = &client->players[slot];
+		*p = *client->proto;
+		p->bullets = calloc(p->bullet_max, sizeof(bullet_t));
+		client->players_loaded[slot] = 1;
+	}
+	return &client->players[slot];
+}
+
+/*
+ * Reads a snapshot packet
+ */
+void net_client_read_snapshot(net_client_t *client, delta_reader_t *r) {
+	const Uint32 tick = delta_get(r, 4),
+	             baseline = delta_get(r, 4),
+	             input_ack = delta_get(r, 4);
+	const int slot = delta_get(r, 1);
+	if (r->error || slot >= NET_MAX_PLAYERS || tick <= client->latest)
+		return;
+
+	/* without the baseline the fields left out are unknown */
+	net_snapshot_t *base = NULL;
+	if (baseline) {
+		base = &client->snapshots[baseline % NET_HISTORY];
+		if (base->tick != baseline)
+			return;
+	}
+
+	net_snapshot_t snapshot;
+	net_get_snapshot(r, &snapshot, base);
+	if (r->error)
+		return;
+	snapshot.tick = tick;
+	snapshot.input_ack = input_ack;
+
+	client->snapshots[tick % NET_HISTORY] = snapshot;
+	client->latest = tick;
+	client->latest_time = SDL_GetTicks();
+	client->slot = slot;
+}
+
+/*
+ * Reads a terrain fragment, applies the delta to `map` once all fragments arrived
+ */
+void net_client_read_terrain(net_client_t *client, delta_reader_t *r, map_t *map) {
+	const Uint32 from = delta_get(r, 4),
+	             to = delta_get(r, 4);
+	const int index = delta_get(r, 2),
+	          count = delta_get(r, 2);
+	const int length = r->size - r->pos;
+	/* no delta of this map takes more fragments, anything else is garbage */
+	const int max_count = (delta_max_size(map) + NET_FRAGMENT_SIZE - 1) / NET_FRAGMENT_SIZE;
+	if (r->error || index >= count || count > max_count || length > NET_FRAGMENT_SIZE || from != map->tick)
+		return;
+
+	/* a newer delta replaces the one being reassembled */
+	if (from != client->terrain_from || to != client->terrain_to || count != client->terrain_count) {
+		Uint8 *terrain = realloc(client->terrain, (size_t)count * NET_FRAGMENT_SIZE);
+		if (terrain)
+			client->terrain = terrain;
+		char *fragments = realloc(client->fragments, count);
+		if (fragments)
+			client->fragments = fragments;
+		if (terrain == NULL || fragments == NULL) {
+			printf("Out of memory for a terrain delta of %d fragments\n", count);
+			client->terrain_count = 0;
+			return;
+		}
+		memset(client->fragments, 0, count);
+		client->terrain_from = from;
+		client->terrain_to = to;
+		client->terrain_count = count;
+		client->terrain_received = 0;
+		client->terrain_size = 0;
+	}
+	if (client->fragments[index])
+		return;
+
+	memcpy(&client->terrain[index * NET_FRAGMENT_SIZE], &r->data[r->pos], length);
+	client->fragments[index] = 1;
+	++client->terrain_received;
+	if (index == count - 1)
+		client->terrain_size = index * NET_FRAGMENT_SIZE + length;
+
+	if (client->terrain_received == count) {
+		delta_apply(map, client->terrain, client->terrain_size);
+		client->terrain_count = 0;
+	}
+}
+
+/*
+ * Reads all pending packets from the server
+ */
+void net_client_receive(net_client_t *client, map_t *map) {
+	Uint8 data[NET_MAX_PACKET];
+	int size;
+
+	while ((size = recv(client->socket, data, sizeof(data), 0)) > 0) {
+		delta_reader_t r = (delta_reader_t) {data, size, 0, 0};
+		switch (delta_get(&r, 1)) {
+			case NET_SNAPSHOT:
+				net_client_read_snapshot(client, &r);
+				break;
+			case NET_TERRAIN:
+				net_client_read_terrain(client, &r, map);
+				break;
+		}
+	}
+}
+
+/*
+ * Sends `input` for the next tick along with what the client has received
+ */
+void net_client_send_input(net_client_t *client, map_t *map, player_input_t *input) {
+	const Uint32 seq = ++client->input_seq;
+	client->inputs[seq % NET_HISTORY] = *input;
+
+	delta_writer_t *w = &client->packet;
+	w->size = 0;
+	delta_put(w, NET_INPUT, 1);
+	delta_put(w, seq, 4);
+	delta_put(w, client->latest, 4);
+	delta_put(w, map->tick, 4);
+	delta_put(w, (Uint8)input->move, 1);
+	delta_put(w, input->buttons, 1);
+	net_put_vector(w, input->aim);
+	net_send(client->socket, w, &client->server);
+}
+
+/*
+ * Predicts our player: starts from the latest snapshot and replays the inputs
+ * the server had not applied yet
+ * Returns our player, NULL before the first snapshot
+ */
+player_t *net_client_predict(net_client_t *client, map_t *map) {
+	if (client->slot < 0)
+		return NULL;
+
+	net_snapshot_t *snapshot = &client->snapshots[client->latest % NET_HISTORY];
+	if (!snapshot->players[client->slot].present)
+		return NULL;
+	player_t *player = net_client_player(client, client->slot);
+	net_restore_player(player, &snapshot->players[client->slot]);
+
+	/* inputs older than the history are lost, the next snapshot corrects that */
+	Uint32 seq = snapshot->input_ack + 1;
+	if (seq + NET_HISTORY <= client->input_seq)
+		seq = client->input_seq - NET_HISTORY + 1;
+
+	/* only the newest input is simulated for the first time, replays are silent */
+	const unsigned walking_frame = player->walking_frame;
+	for (; seq <= client->input_seq; ++seq) {
+		player->muted = seq != client->input_seq;
+		player_apply_movement(player, map, &client->inputs[seq % NET_HISTORY]);
+		player_update(player, map);
+	}
+	player->muted = 0;
+	player->walking_frame = (walking_frame + 1) % player->walking_frame_speed;
+
+	return player;
+}
+
+/*
+ * Returns snapshot `tick` or NULL if it was not received
+ */
+net_snapshot_t *net_client_snapshot(net_client_t *client, Uint32 tick) {
+	net_snapshot_t *snapshot = &client->snapshots[tick % NET_HISTORY];
+	return snapshot->tick == tick ? snapshot : NULL;
+}
+
+/*
+ * Moves the other players to where they were NET_INTERP_TICKS ago, interpolating between snapshots
+ */
+void net_client_interpolate(net_client_t *client) {
+	if (client->latest <= NET_INTERP_TICKS)
+		return;
+
+	/* time shown, in ticks */
+	float t = (float)(SDL_GetTicks() - client->latest_time) / NET_TICK_MS;
+	if (t > 1)
+		t = 1;
+	t += client->latest - NET_INTERP_TICKS;
+
+	/* closest snapshots before and after, lost ones are skipped */
+	const Uint32 tick = t,
+	             oldest = client->latest > NET_HISTORY ? client->latest - NET_HISTORY : 0;
+	net_snapshot_t *a = NULL, *b = NULL;
+	for (Uint32 i = tick; i > oldest && a == NULL; --i) {
+		a = net_client_snapshot(client, i);
+	}
+	for (Uint32 i = tick + 1; i <= client->latest && b == NULL; ++i) {
+		b = net_client_snapshot(client, i);
+	}
+	if (a == NULL && b == NULL)
+		return;
+	if (a == NULL)
+		a = b;
+	if (b == NULL)
+		b = a;
+	const float f = a == b ? 0 : (t - a->tick) / (b->tick - a->tick);
+
+	for (int i = 0; i < NET_MAX_PLAYERS; ++i) {
+		if (i == client->slot || !b->players[i].present)
+			continue;
+
+		net_player_state_t state = b->players[i];
+		if (a->players[i].present) {
+			net_player_state_t *from = &a->players[i];
+			state.pos = vector_add(from->pos, vector_smult(vector_sub(state.pos, from->pos), f));
+			if (from->bullet_active && state.bullet_active)
+				state.bullet_pos = vector_add(from->bullet_pos, vector_smult(vector_sub(state.bullet_pos, from->bullet_pos), f));
+		}
+
+		/* walk animation follows the time shown */
+		player_t *player = net_client_player(client, i);
+		net_restore_player(player, &state);
+		player->walking_frame = tick % player->walking_frame_speed;
+	}
+}
+
+/*
+ * Adds all players present in the latest snapshot to `frame`
+ */
+void net_client_draw(net_client_t *client, map_t *map, frame_t *frame) {
+	net_snapshot_t *snapshot = net_client_snapshot(client, client->latest);
+	if (snapshot == NULL)
+		return;
+
+	for (int i = 0; i < NET_MAX_PLAYERS; ++i) {
+		if (snapshot->players[i].present && client->players_loaded[i])
+			player_draw(&client->players[i], map, frame);
+	}
+}
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef pack_h
+#define pack_h
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <SDL2/SDL.h>
+
+/*
+ * Asset pack, written by tools/pack (see `make pack`)
+ * Holds the files below assets/ and maps/ under their path, so loaders look up
+ * the same names they would open. The pack is mapped read-only and entries are
+ * read in place, opening it is the only file access.
+ *
+ * Layout, all numbers little-endian:
+ *   pack_header_t, `entries_count` pack_index_t sorted by name, names
+ *   entry data, each starting at a multiple of PACK_ALIGN
+ * Entries with PACK_RGBA hold the image already decoded to RGBA (like
+ * lodepng_decode32) instead of the file, starting at a multiple of PACK_PAGE.
+ */
+#define PACK_FILE "data.pack"
+#define PACK_MAGIC 0x4B434150 /* "PACK" */
+#define PACK_VERSION 1
+#define PACK_ALIGN 64
+#define PACK_PAGE 4096
+
+/* Entry is decoded RGBA pixels of `width` x `height` */
+#define PACK_RGBA 1
+
+typedef struct {
+	Uint32 magic, version;
+	Uint32 entries_count;
+	Uint32 names_size;
+} pack_header_t;
+
+typedef struct {
+	/* offset of the zero terminated name in the names */
+	Uint32 name;
+	Uint32 flags;
+	Uint32 width, height;
+	Uint64 offset, size;
+} pack_index_t;
+
+typedef struct {
+	Uint8 *data;
+	size_t size;
+	const pack_index_t *index;
+	const char *names;
+	int entries_count;
+	/* modification time of the pack, used for caches of its entries */
+	time_t mtime;
+} pack_t;
+
+/* Pack the loaders read from, empty if there is none */
+pack_t game_pack = {
+	.data = NULL,
+	.size = 0,
+	.index = NULL,
+	.names = NULL,
+	.entries_count = 0,
+	.mtime = 0
+};
+
+/*
+ * Maps the pack `fn`
+ * Returns 0 on success, loaders use the loose files without it
+ */
+int pack_open(pack_t *pack, const char *fn) {
+	int fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(pack_header_t)) {
+		close(fd);
+		printf("Invalid asset pack '%s'\n", fn);
+		return 1;
+	}
+
+	Uint8 *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		printf("Failed to map asset pack '%s'\n", fn);
+		return 1;
+	}
+
+	const pack_header_t *header = (const pack_header_t *)data;
+	const size_t names = sizeof(pack_header_t) + (size_t)header->entries_count * sizeof(pack_index_t);
+	if (header->magic != PACK_MAGIC || header->version != PACK_VERSION
+	 || names + header->names_size > (size_t)st.st_size) {
+		munmap(data, st.st_size);
+		printf("Invalid asset pack '%s'\n", fn);
+		return 1;
+	}
+
+	const pack_index_t *index = (const pack_index_t *)(data + sizeof(pack_header_t));
+	for (Uint32 i = 0; i < header->entries_count; ++i) {
+		if (index[i].name >= header->names_size || index[i].offset + index[i].size > (Uint64)st.st_size) {
+			munmap(data, st.st_size);
+			printf("Invalid asset pack '%s': entry %u out of range\n", fn, i);
+			return 1;
+		}
+	}
+
+	*pack = (pack_t) {
+		.data = data,
+		.size = st.st_size,
+		.index = index,
+		.names = (const char *)(data + names),
+		.entries_count = header->entries_count,
+		.mtime = st.st_mtime
+	};
+	return 0;
+}
+
+/*
+ * Unmaps the pack, nothing read from it may be used anymore
+ */
+void pack_close(pack_t *pack) {
+	if (pack->data)
+		munmap(pack->data, pack->size);
+	pack->data = NULL;
+	pack->entries_count = 0;
+}
+
+/*
+ * Returns the entry of the file `fn`, NULL if it was not packed
+ */
+const pack_index_t *pack_find(pack_t *pack, const char *fn) {
+	int lo = 0, hi = pack->entries_count - 1;
+	while (lo <= hi) {
+		const int mid = (lo + hi) / 2;
+		const int cmp = strcmp(pack->names + pack->index[mid].name, fn);
+		if (cmp == 0)
+			return &pack->index[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return NULL;
+}
+
+/*
+ * Returns the data of `entry`
+ */
+const Uint8 *pack_data(pack_t *pack, const pack_index_t *entry) {
+	return pack->data + entry->offset;
+}
+
+/*
+ * Opens the packed file `fn` for reading
+ * Returns NULL if it is not packed as a file, the SDL_RWops has to be closed
+ */
+SDL_RWops *pack_rwops(pack_t *pack, const char *fn) {
+	const pack_index_t *entry = pack_find(pack, fn);
+	if (entry == NULL || (entry->flags & PACK_RGBA))
+		return NULL;
+	return SDL_RWFromConstMem(pack_data(pack, entry), entry->size);
+}
+
+#endif
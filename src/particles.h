@@ -0,0 +1,277 @@
+#ifndef particles_h
+#define particles_h
+
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+extern SDL_Renderer *renderer;
+extern SDL_Surface *game_surface;
+
+/* Every n-th tile (in both directions) of an explosion becomes a particle */
+#define PARTICLES_EXPLOSION_STRIDE 2
+/* Particles moved by one job of particles_update */
+#define PARTICLES_JOB_SIZE 4096
+
+/*
+ * Fixed-size pool of debris particles
+ * Stored as structure of arrays, the `count` live particles are packed at the front
+ */
+typedef struct particles_t {
+	float *x, *y, *vx, *vy;
+	Uint32 *color;
+	Uint16 *life;
+	int count, capacity;
+
+	/* random number state */
+	Uint32 seed;
+
+	/* overlay particles are drawn to, only touched by the render thread */
+	SDL_Texture *texture;
+	int texture_w, texture_h;
+} particles_t;
+
+/*
+ * Shared state of a threaded update
+ */
+typedef struct {
+	particles_t *ps;
+	map_t *map;
+} particles_job_t;
+
+/*
+ * Creates a pool for up to `capacity` particles
+ * No memory is allocated after this
+ */
+particles_t particles_new(int capacity) {
+	const size_t stride = 4 * sizeof(float) + sizeof(Uint32) + sizeof(Uint16);
+	char *block = malloc(capacity * stride);
+
+	particles_t ps = (particles_t) {
+		.x     = (float *)block,
+		.y     = (float *)block + capacity,
+		.vx    = (float *)block + capacity * 2,
+		.vy    = (float *)block + capacity * 3,
+		.color = (Uint32 *)(block + capacity * 4 * sizeof(float)),
+		.life  = (Uint16 *)(block + capacity * (4 * sizeof(float) + sizeof(Uint32))),
+		.count = 0,
+		.capacity = capacity,
+		.seed = 0x9E3779B9,
+		.texture = NULL,
+		.texture_w = 0,
+		.texture_h = 0
+	};
+
+	return ps;
+}
+
+/*
+ * Frees the pool
+ */
+void particles_delete(particles_t *ps) {
+	free(ps->x);
+	if (ps->texture)
+		SDL_DestroyTexture(ps->texture);
+}
+
+/*
+ * Returns a pseudo random number (xorshift)
+ */
+Uint32 particles_random(particles_t *ps) {
+	ps->seed ^= ps->seed << 13;
+	ps->seed ^= ps->seed >> 17;
+	ps->seed ^= ps->seed << 5;
+	return ps->seed;
+}
+
+/*
+ * Returns a pseudo random number between `min` and `max`
+ */
+float particles_random_range(particles_t *ps, float min, float max) {
+	return min + (particles_random(ps) & 0xFFFF) * (max - min) / 65535.0;
+}
+
+/*
+ * Adds a particle, does nothing if the pool is full
+ */
+void particles_add(particles_t *ps, float x, float y, float vx, float vy, Uint32 color, Uint16 life) {
+	if (ps->count == ps->capacity)
+		return;
+
+	const int i = ps->count++;
+	ps->x[i] = x;
+	ps->y[i] = y;
+	ps->vx[i] = vx;
+	ps->vy[i] = vy;
+	ps->color[i] = color | MAP_SOLID_ALPHA;
+	ps->life[i] = life;
+}
+
+/*
+ * Turns the solid tiles destroyed by an explosion at `xp`,`yp` with radius `r` into debris
+ * Has to be called before the tiles are removed
+ */
+void particles_emit_explosion(particles_t *ps, map_t *map, const int xp, const int yp, const int r) {
+	for (int x = -r; x <= r; x += PARTICLES_EXPLOSION_STRIDE) {
+		for (int y = -r; y <= r; y += PARTICLES_EXPLOSION_STRIDE) {
+			if (x*x + y*y > r*r || !map_in_bounds(map, xp + x, yp + y) || !map_get_solid(map, xp + x, yp + y))
+				continue;
+
+			/* fly away from the center */
+			const float speed = particles_random_range(ps, 0.5, 4.0) / (r + 1);
+			particles_add(ps, xp + x, yp + y,
+				x * speed, y * speed - particles_random_range(ps, 1.0, 3.0),
+				map_get(map, xp + x, yp + y), 90 + (particles_random(ps) & 127));
+		}
+	}
+}
+
+/*
+ * Moves particles [`begin`, `end`), particles hitting solid tiles bounce and slow down
+ * Particles leaving the map die
+ */
+void particles_update_range(void *data, int begin, int end) {
+	particles_job_t *job = data;
+	particles_t *ps = job->ps;
+	map_t *map = job->map;
+	const float gravity = map->gravity;
+
+	for (int i = begin; i < end; ++i) {
+		ps->vy[i] += gravity;
+		const float nx = ps->x[i] + ps->vx[i],
+		            ny = ps->y[i] + ps->vy[i];
+
+		if (nx < 0 || nx >= map->width || ny < 0 || ny >= map->height) {
+			ps->life[i] = 0;
+			continue;
+		}
+
+		if (map->solid_tiles[(int)nx + (int)ny * map->width]) {
+			/* bounce off, losing most of the energy */
+			ps->vx[i] *= 0.5;
+			ps->vy[i] *= -0.3;
+		} else {
+			ps->x[i] = nx;
+			ps->y[i] = ny;
+		}
+
+		if (ps->life[i] > 0)
+			--ps->life[i];
+	}
+}
+
+/*
+ * Moves all particles and removes dead ones
+ * Dead particles lying on solid ground are turned into sand if the map has a sand layer
+ */
+void particles_update(particles_t *ps, map_t *map) {
+	particles_job_t job = (particles_job_t) {ps, map};
+	jobs_parallel_for(ps->count, PARTICLES_JOB_SIZE, &particles_update_range, &job);
+
+	/* remove dead particles by moving the last one into their place */
+	for (int i = 0; i < ps->count; ++i) {
+		if (ps->life[i] > 0)
+			continue;
+
+		/* particles resting on the ground become sand */
+		const int x = ps->x[i], y = ps->y[i];
+		if (map->sand && map_in_bounds(map, x, y + 1) && map_get_solid(map, x, y + 1))
+			sand_add(map->sand, map, x, y, ps->color[i]);
+
+		const int last = --ps->count;
+		ps->x[i] = ps->x[last];
+		ps->y[i] = ps->y[last];
+		ps->vx[i] = ps->vx[last];
+		ps->vy[i] = ps->vy[last];
+		ps->color[i] = ps->color[last];
+		ps->life[i] = ps->life[last];
+		--i;
+	}
+}
+
+/*
+ * Adds all particles on screen to `frame`
+ */
+void particles_capture(particles_t *ps, map_t *map, frame_t *frame) {
+	frame_reserve((void **)&frame->particles, &frame->particles_max, ps->count, sizeof(frame_particle_t));
+
+	int n = 0;
+	for (int i = 0; i < ps->count; ++i) {
+		const int x = (int)ps->x[i] - (int)map->scroll.x,
+		          y = (int)ps->y[i] - (int)map->scroll.y;
+		if (x < 0 || x >= map->display_rect.w || y < 0 || y >= map->display_rect.h)
+			continue;
+
+		frame->particles[n++] = (frame_particle_t) {x, y, ps->color[i]};
+	}
+	frame->particles_count = n;
+}
+
+/*
+ * Writes the particles of `frame` into `pixels`, which maps to the screen area `area`
+ */
+void particles_rasterize(frame_t *frame, SDL_Rect *area, Uint32 *pixels, int pitch) {
+	for (int i = 0; i < frame->particles_count; ++i) {
+		const int x = frame->particles[i].x - area->x,
+		          y = frame->particles[i].y - area->y;
+
+		*(Uint32 *)((Uint8 *)pixels + y * pitch + x * sizeof(Uint32)) = frame->particles[i].color;
+	}
+}
+
+/*
+ * Draws the particles of `frame` on screen
+ * Particles are drawn into a single overlay, only the part covering particles is uploaded
+ */
+void particles_render(particles_t *ps, map_t *map, frame_t *frame) {
+	if (frame->particles_count == 0)
+		return;
+
+	/* screen area covered by particles */
+	int x0 = map->display_rect.w, y0 = map->display_rect.h, x1 = -1, y1 = -1;
+	for (int i = 0; i < frame->particles_count; ++i) {
+		const int x = frame->particles[i].x,
+		          y = frame->particles[i].y;
+		if (x < x0) x0 = x;
+		if (x > x1) x1 = x;
+		if (y < y0) y0 = y;
+		if (y > y1) y1 = y;
+	}
+
+	SDL_Rect area = (SDL_Rect) {x0, y0, x1 - x0 + 1, y1 - y0 + 1};
+
+	/* compositor: draw straight into the window */
+	if (game_surface) {
+		SDL_RenderFlush(renderer);
+		if (SDL_MUSTLOCK(game_surface))
+			SDL_LockSurface(game_surface);
+		particles_rasterize(frame, &area, (Uint32 *)((Uint8 *)game_surface->pixels + y0 * game_surface->pitch) + x0, game_surface->pitch);
+		if (SDL_MUSTLOCK(game_surface))
+			SDL_UnlockSurface(game_surface);
+		return;
+	}
+
+	if (ps->texture == NULL || ps->texture_w != map->display_rect.w || ps->texture_h != map->display_rect.h) {
+		if (ps->texture)
+			SDL_DestroyTexture(ps->texture);
+		ps->texture_w = map->display_rect.w;
+		ps->texture_h = map->display_rect.h;
+		ps->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, ps->texture_w, ps->texture_h);
+		SDL_SetTextureBlendMode(ps->texture, SDL_BLENDMODE_BLEND);
+	}
+
+	void *pixels;
+	int pitch;
+	if (SDL_LockTexture(ps->texture, &area, &pixels, &pitch) != 0)
+		return;
+	/* locked pixels are undefined */
+	for (int y = 0; y < area.h; ++y) {
+		memset((Uint8 *)pixels + y * pitch, 0, area.w * sizeof(Uint32));
+	}
+	particles_rasterize(frame, &area, pixels, pitch);
+	SDL_UnlockTexture(ps->texture);
+
+	SDL_RenderCopy(renderer, ps->texture, &area, &area);
+}
+
+#endif
@@ -12,10 +12,34 @@ struct bullet_t;
 #include "map.h"
 #include "atlas.h"
 #include "soundatlas.h"
+#include "frame.h"
+#include "stream.h"
 
 extern SDL_Window *window;
 extern SDL_Renderer *renderer;
-extern vector_t mouse;
+
+/* Players moved by one job of players_update, a player is cheap so small teams run inline */
+#define PLAYERS_JOB_SIZE 16
+
+/* Images of a player without packed atlas pages */
+#define PLAYER_SKIN_FILE "assets/Kenney/Extra_animations_and_enemies/Spritesheets/alienGreen.png"
+#define PLAYER_SPRITES_FILE "assets/player/sprites.png"
+
+/* Sound effects of a player and their names, in the order of their handles */
+#define PLAYER_SOUNDS 6
+const char *player_sound_files[PLAYER_SOUNDS][2] = {
+	{"assets/sounds/jump.wav", "jump_1"},
+	{"assets/sounds/jump2.wav", "jump_2"},
+	{"assets/sounds/explode.wav", "explode_1"},
+	{"assets/sounds/explode_small.wav", "explode_small_1"},
+	{"assets/sounds/shoot.wav", "shoot_1"},
+	{"assets/sounds/hurt1.wav", "hurt_1"}
+};
+
+/* Buttons of player_input_t */
+#define PLAYER_JUMP 1
+#define PLAYER_FIRE 2
+#define PLAYER_BUILD 4
 
 typedef struct bullet_t {
 	vector_t pos, vel;
@@ -53,11 +77,66 @@ typedef struct player_t {
 	atlas_t skin;
 	unsigned walking_frame, walking_frame_speed;
 	SDL_RendererFlip animation_flip;
+	/* direction passed to the last player_move */
+	float walk_dir;
 
 	/* sounds */
 	soundatlas_t sounds;
+	/* handles of `sounds` played in game */
+	int sound_jump[2], sound_explode, sound_shoot, sound_hurt;
+	/* do not play sounds, used while replaying predicted input */
+	int muted;
 } player_t;
 
+/*
+ * What a player does in one tick
+ */
+typedef struct {
+	/* -1 left, 1 right, 0 none */
+	Sint8 move;
+	/* PLAYER_* flags */
+	Uint8 buttons;
+	/* point aimed at, in map coordinates */
+	vector_t aim;
+} player_input_t;
+
+/*
+ * Players of a match in one contiguous array, each with its input of the current tick
+ * Textures, sounds and settings are loaded once into `proto` and shared by all.
+ * The array never grows, so pointers to players (bullet owners) stay valid.
+ */
+typedef struct {
+	player_t proto;
+	player_t *players;
+	player_input_t *inputs;
+	int count, max;
+} players_t;
+
+/*
+ * Shared state of a threaded update
+ */
+typedef struct {
+	players_t *ps;
+	map_t *map;
+} players_job_t;
+
+/*
+ * Requests the images and sounds of a player from the streaming worker
+ * Call before the first player_new, which then waits for them at most
+ */
+void player_request_assets(int priority) {
+	atlas_packed_t *packed = atlas_pages_find("player/sprites");
+	if (packed && packed->page < atlas_pages.pages_count) {
+		stream_request_texture(atlas_pages.page_paths[packed->page], priority);
+	} else {
+		stream_request_texture(PLAYER_SKIN_FILE, priority);
+		stream_request_texture(PLAYER_SPRITES_FILE, priority);
+	}
+	for (int i = 0; i < PLAYER_SOUNDS; ++i) {
+		stream_request_sound(player_sound_files[i][0], priority);
+	}
+}
+
 /*
  * Create a new player at `x`,`y`
  */
@@ -75,41 +154,74 @@ player_t player_new(float x, float y, float w, float h) {
 		.max_speed = 0.8,
 		.turn_speed = .7,
 		.max_fallspeed = 13,
-		.bullets = malloc(3 * sizeof(bullet_t)),
+		.bullets = calloc(3, sizeof(bullet_t)),
 		.bullet_i = 0,
 		.bullet_max = 3,
 		.aim_dir = vector_new(1, 0),
 		.aim_dir_len = 10,
 		.aim_angle = 90,
 		.aiming_dots = 4,
-		.skin = atlas_new(game_load_texture("assets/Kenney/Extra_animations_and_enemies/Spritesheets/alienGreen.png"), 7),
+		.skin = atlas_new(NULL, 7),
 		.walking_frame = 0,
 		.walking_frame_speed = 40,
 		.animation_flip = SDL_FLIP_NONE,
+		.walk_dir = 0,
 		.sounds = soundatlas_new(10),
-		.sprites = atlas_new(game_load_texture("assets/player/sprites.png"), 1)
+		.muted = 0,
+		.sprites = atlas_new(NULL, 2)
 	};
 
-	/* Add animation sprites */
-	atlas_add_sprite(&p.skin, 70,  92, 66, 92); /* default, id=0 */
-	atlas_add_sprite(&p.skin,  0, 380, 69, 71); /* duck */
-	atlas_add_sprite(&p.skin,  0, 288, 69, 92); /* hurt */
-	atlas_add_sprite(&p.skin, 69, 286, 67, 93); /* jump */
-	atlas_add_sprite(&p.skin, 69, 379, 67, 92); /* stand */
-	atlas_add_sprite(&p.skin, 69, 193, 68, 93); /* walk1 */
-	atlas_add_sprite(&p.skin,  0,   0, 70, 96); /* walk2, id=6 */
-	
-	/* Add sprites */
-	atlas_add_sprite(&p.sprites, 0, 0, 8, 8); /* bullet, id=0 */
-	atlas_add_sprite(&p.sprites, 8, 0, 17, 19); /* grenade */
+	/* Use the packed atlas pages if the images were packed, skin and sprites share a page */
+	static const char *skin_frames[7] = {
+		"", "_duck", "_hurt", "_jump", "_stand", "_walk1", "_walk2"
+	};
+	const SDL_Rect bullet = {0, 0, 8, 8}, grenade = {8, 0, 17, 19};
+	int packed = atlas_pages_find("player/sprites") != NULL;
+	for (int i = 0; i < 7 && packed; ++i) {
+		char name[128];
+		sprintf(name, "Kenney/Extra_animations_and_enemies/Alien sprites/alienGreen%s", skin_frames[i]);
+		packed = atlas_add_packed(&p.skin, name, NULL) == i;
+	}
+	packed = packed
+		&& atlas_add_packed(&p.sprites, "player/sprites", &bullet) == 0
+		&& atlas_add_packed(&p.sprites, "player/sprites", &grenade) == 1;
+
+	if (!packed) {
+		atlas_delete(&p.skin);
+		atlas_delete(&p.sprites);
+		p.skin = atlas_new(game_load_texture(PLAYER_SKIN_FILE), 7);
+		p.sprites = atlas_new(game_load_texture(PLAYER_SPRITES_FILE), 2);
+
+		/* Add animation sprites */
+		atlas_add_sprite(&p.skin, 70,  92, 66, 92); /* default, id=0 */
+		atlas_add_sprite(&p.skin,  0, 380, 69, 71); /* duck */
+		atlas_add_sprite(&p.skin,  0, 288, 69, 92); /* hurt */
+		atlas_add_sprite(&p.skin, 69, 286, 67, 93); /* jump */
+		atlas_add_sprite(&p.skin, 69, 379, 67, 92); /* stand */
+		atlas_add_sprite(&p.skin, 69, 193, 68, 93); /* walk1 */
+		atlas_add_sprite(&p.skin,  0,   0, 70, 96); /* walk2, id=6 */
+
+		/* Add sprites */
+		atlas_add_sprite(&p.sprites, 0, 0, 8, 8); /* bullet, id=0 */
+		atlas_add_sprite(&p.sprites, 8, 0, 17, 19); /* grenade */
+	}
 	
 	/* Add sounds to atlas */
-	soundatlas_add(&p.sounds, "assets/sounds/jump.wav", "jump_1");
-	soundatlas_add(&p.sounds, "assets/sounds/jump2.wav", "jump_2");
-	soundatlas_add(&p.sounds, "assets/sounds/explode.wav", "explode_1");
-	soundatlas_add(&p.sounds, "assets/sounds/explode_small.wav", "explode_small_1");
-	soundatlas_add(&p.sounds, "assets/sounds/shoot.wav", "shoot_1");
-	soundatlas_add(&p.sounds, "assets/sounds/hurt1.wav", "hurt_1");
+	for (int i = 0; i < PLAYER_SOUNDS; ++i) {
+		soundatlas_add(&p.sounds, player_sound_files[i][0], player_sound_files[i][1]);
+	}
+	p.sound_jump[0] = 0;
+	p.sound_jump[1] = 1;
+	p.sound_explode = 2;
+	p.sound_shoot = 4;
+	p.sound_hurt = 5;
+
+	/* explosions and hits matter more than footwork when channels run out */
+	soundatlas_set_voice(&p.sounds, p.sound_jump[0], VOICE_PRIORITY_LOW, 2);
+	soundatlas_set_voice(&p.sounds, p.sound_jump[1], VOICE_PRIORITY_LOW, 2);
+	soundatlas_set_voice(&p.sounds, p.sound_explode, VOICE_PRIORITY_HIGH, 4);
+	soundatlas_set_voice(&p.sounds, p.sound_shoot, VOICE_PRIORITY_NORMAL, 3);
+	soundatlas_set_voice(&p.sounds, p.sound_hurt, VOICE_PRIORITY_HIGH, 2);
 
 	return p;
 }
@@ -136,7 +248,7 @@ void behave_shot(bullet_t *shot, map_t *map) {
 	if ((dst = map_raycast(map, shot->pos, shot->vel)) < vector_len(shot->vel)) {
 		map_explode(map, shot->pos.x, shot->pos.y, 10, 4, RGB(140, 80, 65));
 		shot->active = 0;
-		soundatlas_play(&shot->owner->sounds, "hurt_1");
+		soundatlas_play_at(&shot->owner->sounds, shot->owner->sound_hurt, shot->pos.x, shot->pos.y);
 		return;
 	}
 }
@@ -165,7 +277,7 @@ void behave_drill(bullet_t *shot, map_t *map) {
  * WEAPON: GRENADE
  */
 void bullet_grenade_create(bullet_t *grenade) {
-	soundatlas_play(&grenade->owner->sounds, "shoot_1");
+	soundatlas_play_at(&grenade->owner->sounds, grenade->owner->sound_shoot, grenade->pos.x, grenade->pos.y);
 }
 void bullet_grenade_behave(bullet_t *grenade, map_t *map) {
 	if (!grenade->active) {
@@ -193,7 +305,7 @@ void bullet_grenade_behave(bullet_t *grenade, map_t *map) {
 	grenade->pos = vector_add(grenade->pos, grenade->vel);
 	
 	if (grenade->ticks_alive > 260) {
-		soundatlas_play(&grenade->owner->sounds, "explode_1");
+		soundatlas_play_at(&grenade->owner->sounds, grenade->owner->sound_explode, grenade->pos.x, grenade->pos.y);
 		map_explode(map, grenade->pos.x, grenade->pos.y, 25, 4, RGB(140, 80, 65));
 		grenade->active = 0;
 	}
@@ -214,6 +326,7 @@ void player_grenade_new(player_t *player) {
 		.ctx = duk_create_heap_default(),
 		.owner = player,
 	};
+	bullet_delete(&player->bullets[player->bullet_i]);
 	player->bullets[player->bullet_i] = grenade;
 	
 }
@@ -305,6 +418,8 @@ void player_fall(player_t *player, map_t *map) {
  * Handles movement to right/left and collision
  */
 void player_move(player_t *player, map_t *map, float dir) {
+	player->walk_dir = dir;
+
 	/* if not moving in any direction, slow down */
 	if (dir == 0) {
 		player->vel.x *= player->drag;
@@ -365,10 +480,12 @@ void player_jump(player_t *player, map_t *map) {
 		player->vel.y = -player->jump_vel;
 		
 		/* random jump sound */
+		if (player->muted)
+			return;
 		if ((int)(player->pos.x + player->pos.y + player->vel.x + player->vel.y) % 2 == 0)
-			soundatlas_play(&player->sounds, "jump_1");
+			soundatlas_play_at(&player->sounds, player->sound_jump[0], player->pos.x, player->pos.y);
 		else
-			soundatlas_play(&player->sounds, "jump_2");
+			soundatlas_play_at(&player->sounds, player->sound_jump[1], player->pos.x, player->pos.y);
 			
 	}
 }
@@ -389,14 +506,65 @@ void player_jump_collide(player_t *player, map_t *map) {
 	}
 }
 
+/*
+ * Aims at `aim` (map coordinates)
+ */
+void player_aim(player_t *player, vector_t aim) {
+	player->aim_dir = vector_sub(aim, vector_add(player->pos, player->tocenter));
+	vector_setlen(&player->aim_dir, player->aim_dir_len);
+}
+
+/*
+ * Applies the aiming and movement of `input`, the part of it clients can predict
+ */
+void player_apply_movement(player_t *player, map_t *map, player_input_t *input) {
+	player_aim(player, input->aim);
+	player_move(player, map, input->move);
+	if (input->buttons & PLAYER_JUMP)
+		player_jump(player, map);
+}
+
+/*
+ * Applies the actions of `input` that change the world
+ */
+void player_apply_actions(player_t *player, map_t *map, player_input_t *input) {
+	if (input->buttons & PLAYER_FIRE)
+		player_grenade_new(player);
+	if (input->buttons & PLAYER_BUILD)
+		map_edit_rect(map, input->aim.x, input->aim.y, 30, 14, 0x313574, 1);
+}
+
+/*
+ * Applies everything `player` does in this tick
+ */
+void player_apply_input(player_t *player, map_t *map, player_input_t *input) {
+	player_apply_movement(player, map, input);
+	player_apply_actions(player, map, input);
+}
+
+/*
+ * Returns input that does nothing and keeps the current aim
+ */
+player_input_t player_idle_input(player_t *player) {
+	return (player_input_t) {
+		.move = 0,
+		.buttons = 0,
+		.aim = vector_add(vector_add(player->pos, player->tocenter), player->aim_dir)
+	};
+}
+
+/*
+ * Moves the projectiles of `player`
+ */
+void player_update_bullets(player_t *player, map_t *map) {
+	if (player->bullets[0].rad > 1)
+		player->bullets[0].behave(&player->bullets[0], map);
+}
+
 /*
  * Update everything player-related (collision and movement etc)
  */
 void player_update(player_t *player, map_t *map) {
-	/* Aiming */
-	player->aim_dir = vector_sub(vector_add(mouse, map->scroll), vector_add(player->pos, player->tocenter));
-	vector_setlen(&player->aim_dir, player->aim_dir_len);
-	
 	/* Physics */
 	player_fall(player, map);
 	player_jump_collide(player, map);
@@ -412,11 +580,9 @@ void player_update(player_t *player, map_t *map) {
 }
 
 /*
- * Renders `player` to renderer
+ * Adds `player` to `frame`
  */
-void player_render(player_t *player, map_t *map) {
-	
-	const Uint8 *key = SDL_GetKeyboardState(NULL);	
+void player_draw(player_t *player, map_t *map, frame_t *frame) {
 	SDL_Rect player_realdst = (SDL_Rect){
 		player->pos.x - player->size.x / 2 - map->scroll.x,
 		player->pos.y - player->size.y - map->scroll.y,
@@ -426,17 +592,17 @@ void player_render(player_t *player, map_t *map) {
 	
 	/* How to display player */
 	if (player->vel.y == 0) {
-		if (key[SDL_SCANCODE_D]) {
+		if (player->walk_dir > 0) {
 			player->animation_flip = SDL_FLIP_NONE;
-			atlas_render_ex(&player->skin, (player->walking_frame < (player->walking_frame_speed / 2) ? 5 : 6), &player_realdst, 0, player->animation_flip);
-		} else if (key[SDL_SCANCODE_A]) {
+			frame_add_sprite(frame, &player->skin, (player->walking_frame < (player->walking_frame_speed / 2) ? 5 : 6), &player_realdst, 0, player->animation_flip);
+		} else if (player->walk_dir < 0) {
 			player->animation_flip = SDL_FLIP_HORIZONTAL;
-			atlas_render_ex(&player->skin, (player->walking_frame < (player->walking_frame_speed / 2) ? 5 : 6), &player_realdst, 0, player->animation_flip);
+			frame_add_sprite(frame, &player->skin, (player->walking_frame < (player->walking_frame_speed / 2) ? 5 : 6), &player_realdst, 0, player->animation_flip);
 		} else {
-			atlas_render_ex(&player->skin, 4, &player_realdst, 0, player->animation_flip);
+			frame_add_sprite(frame, &player->skin, 4, &player_realdst, 0, player->animation_flip);
 		}
 	} else {
-		atlas_render_ex(&player->skin, 3, &player_realdst, 0, player->animation_flip);
+		frame_add_sprite(frame, &player->skin, 3, &player_realdst, 0, player->animation_flip);
 	}
 
 	vector_t dot_pos = vector_add(player->pos, player->tocenter);
@@ -444,7 +610,7 @@ void player_render(player_t *player, map_t *map) {
 		dot_pos = vector_add(vector_add(player->pos, player->tocenter), player->aim_dir);
 		dot_pos = vector_add(dot_pos, vector_smult(player->aim_dir, i));
 
-		aacircleRGBA(renderer, dot_pos.x - map->scroll.x, dot_pos.y - map->scroll.y, 2, 255, 255, 255, 255);
+		frame_add_circle(frame, dot_pos.x - map->scroll.x, dot_pos.y - map->scroll.y, 2, 255, 255, 255, 255);
 	}
 	
 	/* draw bullets */
@@ -457,9 +623,101 @@ void player_render(player_t *player, map_t *map) {
 			player->bullets[0].pos.y - map->scroll.y - bh/2,
 			bw, bh
 		};
-		atlas_render_ex(&player->sprites, 1, &sprite_dst, -player->bullets[0].vel.x, SDL_FLIP_NONE);
+		frame_add_sprite(frame, &player->sprites, 1, &sprite_dst, -player->bullets[0].vel.x, SDL_FLIP_NONE);
+	}
+
+}
+
+/*
+ * Creates room for `max` players, loading their assets and settings from `config`
+ */
+players_t players_new(int max, const char *config) {
+	players_t ps = (players_t) {
+		.proto = player_new(0, 0, 1, 1),
+		.players = calloc(max, sizeof(player_t)),
+		.inputs = calloc(max, sizeof(player_input_t)),
+		.count = 0,
+		.max = max
+	};
+	player_loadconfig(&ps.proto, config);
+
+	return ps;
+}
+
+/*
+ * Frees all players and the shared assets
+ */
+void players_delete(players_t *ps) {
+	for (int i = 0; i < ps->count; ++i) {
+		bullet_delete(&ps->players[i].bullets[0]);
+		free(ps->players[i].bullets);
+	}
+	free(ps->players);
+	free(ps->inputs);
+	player_delete(&ps->proto);
+}
+
+/*
+ * Adds a player at `x`,`y`
+ * Returns its index or -1 if there is no room
+ */
+int players_add(players_t *ps, float x, float y) {
+	if (ps->count == ps->max)
+		return -1;
+
+	const int i = ps->count++;
+	player_t *p = &ps->players[i];
+	*p = ps->proto;
+	p->pos = vector_new(x, y);
+	p->bullets = calloc(p->bullet_max, sizeof(bullet_t));
+	ps->inputs[i] = player_idle_input(p);
+
+	return i;
+}
+
+/*
+ * Applies the movement of players [`begin`, `end`)
+ */
+void players_move_range(void *data, int begin, int end) {
+	players_job_t *job = data;
+	for (int i = begin; i < end; ++i) {
+		player_apply_movement(&job->ps->players[i], job->map, &job->ps->inputs[i]);
+	}
+}
+
+/*
+ * Runs physics and animation of players [`begin`, `end`)
+ */
+void players_update_range(void *data, int begin, int end) {
+	players_job_t *job = data;
+	for (int i = begin; i < end; ++i) {
+		player_update(&job->ps->players[i], job->map);
 	}
+}
+
+/*
+ * Applies the inputs and advances all players by one tick
+ * Movement and physics only touch the player itself and run in parallel,
+ * actions and projectiles queue map edits and run in order.
+ */
+void players_update(players_t *ps, map_t *map) {
+	players_job_t job = (players_job_t) {ps, map};
 
+	jobs_parallel_for(ps->count, PLAYERS_JOB_SIZE, &players_move_range, &job);
+	for (int i = 0; i < ps->count; ++i) {
+		player_apply_actions(&ps->players[i], map, &ps->inputs[i]);
+		player_update_bullets(&ps->players[i], map);
+	}
+	jobs_parallel_for(ps->count, PLAYERS_JOB_SIZE, &players_update_range, &job);
+}
+
+/*
+ * Adds all players to `frame`
+ */
+void players_draw(players_t *ps, map_t *map, frame_t *frame) {
+	for (int i = 0; i < ps->count; ++i) {
+		player_draw(&ps->players[i], map, frame);
+	}
 }
 
 #endif
@@ -0,0 +1,232 @@
+#ifndef sand_h
+#define sand_h
+
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+/* Ticks a chunk keeps being simulated after the last tile in it moved */
+#define SAND_AWAKE_TICKS 8
+
+/*
+ * Loose tiles (sand, rubble) falling through the map
+ * Only awake chunks are simulated. Chunk rows are processed as strips, first all
+ * even rows then all odd rows, so strips running at the same time never touch
+ * the same tiles.
+ */
+typedef struct sand_t {
+	/* 0 for tiles that are not loose, otherwise the tick parity (1 or 2) they last moved in */
+	Uint8 *loose;
+	/* ticks left until a chunk falls asleep, 0 = asleep */
+	Uint8 *active;
+	int chunks_w, chunks_h;
+
+	Uint32 tick;
+} sand_t;
+
+/*
+ * State of one pass of sand_update
+ */
+typedef struct {
+	sand_t *sand;
+	map_t *map;
+	/* process chunk rows with this parity */
+	int parity;
+	/* stamp of the current tick */
+	Uint8 stamp;
+} sand_job_t;
+
+/*
+ * Creates an empty sand layer for `map`
+ */
+sand_t sand_new(map_t *map) {
+	sand_t sand = (sand_t) {
+		.loose = calloc(map->width * map->height, sizeof(Uint8)),
+		.active = calloc(map->chunks_w * map->chunks_h, sizeof(Uint8)),
+		.chunks_w = map->chunks_w,
+		.chunks_h = map->chunks_h,
+		.tick = 0
+	};
+
+	return sand;
+}
+
+/*
+ * Frees the sand layer
+ */
+void sand_delete(sand_t *sand) {
+	free(sand->loose);
+	free(sand->active);
+}
+
+/*
+ * Wakes the chunk containing `x`,`y`
+ */
+void sand_wake(sand_t *sand, map_t *map, const int x, const int y) {
+	if (!map_in_bounds(map, x, y))
+		return;
+	sand->active[(x >> MAP_CHUNK_SHIFT) + (y >> MAP_CHUNK_SHIFT) * sand->chunks_w] = SAND_AWAKE_TICKS;
+}
+
+/*
+ * Wakes all chunks touching the area from `x0`,`y0` to `x1`,`y1`
+ */
+void sand_wake_area(sand_t *sand, map_t *map, int x0, int y0, int x1, int y1) {
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 >= map->width) x1 = map->width - 1;
+	if (y1 >= map->height) y1 = map->height - 1;
+
+	for (int cy = y0 >> MAP_CHUNK_SHIFT; cy <= y1 >> MAP_CHUNK_SHIFT; ++cy) {
+		for (int cx = x0 >> MAP_CHUNK_SHIFT; cx <= x1 >> MAP_CHUNK_SHIFT; ++cx) {
+			sand->active[cx + cy * sand->chunks_w] = SAND_AWAKE_TICKS;
+		}
+	}
+}
+
+/*
+ * Places a loose tile of color `c` at `x`,`y` if it is free
+ */
+void sand_add(sand_t *sand, map_t *map, const int x, const int y, Uint32 c) {
+	if (!map_in_bounds(map, x, y) || map_get_solid(map, x, y))
+		return;
+
+	map_set_solid(map, x, y, c, 1);
+	sand->loose[x + y * map->width] = 1;
+	sand_wake(sand, map, x, y);
+}
+
+/*
+ * Makes the solid tile at `x`,`y` loose
+ */
+void sand_loosen(sand_t *sand, map_t *map, const int x, const int y) {
+	if (!map_get_solid(map, x, y))
+		return;
+
+	sand->loose[x + y * map->width] = 1;
+	sand_wake(sand, map, x, y);
+}
+
+/*
+ * Makes all solid tiles within `r` of `xp`,`yp` loose and wakes the chunks around them
+ */
+void sand_loosen_circle(sand_t *sand, map_t *map, const int xp, const int yp, const int r) {
+	for (int x = -r; x <= r; ++x) {
+		for (int y = -r; y <= r; ++y) {
+			if (x*x + y*y <= r*r && map_in_bounds(map, xp + x, yp + y)) {
+				sand_loosen(sand, map, xp + x, yp + y);
+			}
+		}
+	}
+
+	/* tiles above may have lost their support */
+	sand_wake_area(sand, map, xp - r - 1, yp - r - MAP_CHUNK_SIZE, xp + r + 1, yp + r + 1);
+}
+
+/*
+ * Moves the loose tile at index `from` to `to`, keeping its color
+ */
+void sand_move(sand_t *sand, map_t *map, const int from, const int to, const Uint8 stamp) {
+	map->rgb_tiles[to] = map->rgb_tiles[from];
+	map->solid_tiles[to] = map->solid_tiles[from];
+	map->rgb_tiles[from] = map->back_rgb_tiles[from];
+	map->solid_tiles[from] = 0;
+	sand->loose[to] = stamp;
+	sand->loose[from] = 0;
+
+	const int fx = from % map->width, fy = from / map->width,
+	          tx = to % map->width, ty = to / map->width;
+	map_mark_dirty(map, fx, fy);
+	map_mark_dirty(map, tx, ty);
+
+	/* wake the destination and whatever was resting on this tile */
+	sand_wake(sand, map, tx, ty);
+	sand_wake(sand, map, fx - 1, fy - 1);
+	sand_wake(sand, map, fx + 1, fy - 1);
+}
+
+/*
+ * Simulates the awake chunks of chunk rows 2 * [`begin`, `end`) + parity
+ */
+void sand_update_strips(void *data, int begin, int end) {
+	sand_job_t *job = data;
+	sand_t *sand = job->sand;
+	map_t *map = job->map;
+	const int w = map->width;
+	/* alternate the preferred direction every tick to avoid drifting to one side */
+	const int side = (sand->tick & 1) ? 1 : -1;
+
+	for (int strip = begin; strip < end; ++strip) {
+		const int cy = strip * 2 + job->parity;
+		const int y0 = cy << MAP_CHUNK_SHIFT;
+		int y1 = y0 + MAP_CHUNK_SIZE;
+		if (y1 > map->height)
+			y1 = map->height;
+
+		for (int cx = 0; cx < sand->chunks_w; ++cx) {
+			Uint8 *active = &sand->active[cx + cy * sand->chunks_w];
+			if (*active == 0)
+				continue;
+
+			const int x0 = cx << MAP_CHUNK_SHIFT;
+			int x1 = x0 + MAP_CHUNK_SIZE;
+			if (x1 > w)
+				x1 = w;
+
+			int moved = 0;
+			/* bottom up, so tiles only move once */
+			for (int y = y1 - 1; y >= y0; --y) {
+				if (y + 1 >= map->height)
+					continue;
+
+				for (int x = x0; x < x1; ++x) {
+					const int i = x + y * w;
+					if (!sand->loose[i] || sand->loose[i] == job->stamp)
+						continue;
+					/* destroyed since it was loosened */
+					if (!map->solid_tiles[i]) {
+						sand->loose[i] = 0;
+						continue;
+					}
+					sand->loose[i] = job->stamp;
+
+					const int below = i + w;
+					if (!map->solid_tiles[below]) {
+						sand_move(sand, map, i, below, job->stamp);
+						moved = 1;
+					} else if (x + side >= 0 && x + side < w && !map->solid_tiles[below + side]) {
+						sand_move(sand, map, i, below + side, job->stamp);
+						moved = 1;
+					} else if (x - side >= 0 && x - side < w && !map->solid_tiles[below - side]) {
+						sand_move(sand, map, i, below - side, job->stamp);
+						moved = 1;
+					}
+				}
+			}
+
+			if (moved)
+				*active = SAND_AWAKE_TICKS;
+			else
+				--*active;
+		}
+	}
+}
+
+/*
+ * Lets all loose tiles in awake chunks fall by one tile
+ */
+void sand_update(sand_t *sand, map_t *map) {
+	++sand->tick;
+	sand_job_t job = (sand_job_t) {
+		.sand = sand,
+		.map = map,
+		.stamp = 1 + (sand->tick & 1)
+	};
+
+	/* even strips, then odd strips */
+	for (job.parity = 0; job.parity < 2; ++job.parity) {
+		jobs_parallel_for((sand->chunks_h + 1 - job.parity) / 2, 1, &sand_update_strips, &job);
+	}
+}
+
+#endif
@@ -1,37 +1,343 @@
 #ifndef sound_h
 #define sound_h
 
+#include "pack.h"
+#include "voice.h"
+
+int stream_finish(const char *);
+
+/*
+ * PCM cache, written next to a sound effect the first time it is loaded
+ * Holds the samples already converted to the format the mixer was opened with,
+ * after a sound_pcm_header_t. Sounds play straight from a mapping of the file,
+ * so loading a cached sound is an mmap instead of parsing and converting the WAV.
+ * The cache is written again when the mixer format or the sound changes.
+ */
+#define SOUND_PCM_SUFFIX ".pcm"
+#define SOUND_PCM_MAGIC 0x4D435053 /* "SPCM" */
+#define SOUND_PCM_VERSION 1
+
+typedef struct {
+	Uint32 magic, version;
+	/* mixer format of the samples */
+	Uint32 frequency, format, channels;
+	Uint32 size;
+} sound_pcm_header_t;
+
 typedef struct {
 	Mix_Chunk *chunk;
 } sound_t;
 
 /*
- * Loads a new sound effect (currently only WAV)
+ * Loaded sound effect, shared by every sound_t created from the same file
  */
-sound_t sound_new(const char *fn) {
+typedef struct {
+	char *path;
+	Mix_Chunk *chunk;
+	int refs;
+	/* mapping of the PCM cache the chunk plays from, NULL if it was loaded from the WAV */
+	void *pcm;
+	size_t pcm_size;
+} sound_cache_entry_t;
+
+typedef struct {
+	sound_cache_entry_t *entries;
+	int entries_count, entries_max;
+	SDL_SpinLock lock;
+} sound_cache_t;
+
+sound_cache_t sound_cache = {
+	.entries = NULL,
+	.entries_count = 0,
+	.entries_max = 0,
+	.lock = 0
+};
+
+/*
+ * Returns the cached chunk of `fn` with a new reference, NULL if it is not cached
+ * sound_cache.lock has to be held
+ */
+Mix_Chunk *sound_find(const char *fn) {
+	for (int i = 0; i < sound_cache.entries_count; ++i) {
+		sound_cache_entry_t *entry = &sound_cache.entries[i];
+		if (!strcmp(entry->path, fn)) {
+			++entry->refs;
+			return entry->chunk;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Returns the name of the PCM cache of `fn`, which has to be freed
+ */
+char *sound_pcm_file(const char *fn) {
+	char *pcm = malloc(strlen(fn) + strlen(SOUND_PCM_SUFFIX) + 1);
+	strcpy(pcm, fn);
+	strcat(pcm, SOUND_PCM_SUFFIX);
+	return pcm;
+}
+
+/*
+ * Returns 1 if `header` describes samples in the format the mixer was opened with
+ */
+int sound_pcm_matches(sound_pcm_header_t *header) {
+	int frequency, channels;
+	Uint16 format;
+	return Mix_QuerySpec(&frequency, &format, &channels)
+		&& header->magic == SOUND_PCM_MAGIC && header->version == SOUND_PCM_VERSION
+		&& header->frequency == (Uint32)frequency && header->format == format && header->channels == (Uint32)channels;
+}
+
+/*
+ * Returns 1 if the PCM cache `pcm` is in the mixer format and newer than the sound `fn`
+ * Sounds in game_pack are as old as the pack
+ */
+int sound_pcm_fresh(const char *fn, const char *pcm) {
+	struct stat cache, source;
+	if (stat(pcm, &cache) != 0)
+		return 0;
+
+	sound_pcm_header_t header;
+	FILE *f = fopen(pcm, "rb");
+	if (f == NULL)
+		return 0;
+	const int read = fread(&header, sizeof(header), 1, f) == 1;
+	fclose(f);
+	if (!read || !sound_pcm_matches(&header))
+		return 0;
+
+	if (pack_find(&game_pack, fn))
+		return game_pack.mtime <= cache.st_mtime;
+	return stat(fn, &source) == 0 && source.st_mtime <= cache.st_mtime;
+}
+
+/*
+ * Converts the sound `fn` to the mixer format and writes it to the PCM cache `pcm`
+ * Returns 0 on success
+ */
+int sound_save_pcm(const char *fn, const char *pcm) {
+	int frequency, channels;
+	Uint16 format;
+	if (!Mix_QuerySpec(&frequency, &format, &channels))
+		return 1;
+
+	SDL_RWops *rw = pack_rwops(&game_pack, fn);
+	SDL_AudioSpec spec;
+	Uint8 *samples;
+	Uint32 length;
+	if (SDL_LoadWAV_RW(rw ? rw : SDL_RWFromFile(fn, "rb"), 1, &spec, &samples, &length) == NULL)
+		return 1;
+
+	SDL_AudioCVT cvt;
+	if (SDL_BuildAudioCVT(&cvt, spec.format, spec.channels, spec.freq, format, channels, frequency) < 0) {
+		SDL_FreeWAV(samples);
+		return 1;
+	}
+	cvt.len = length;
+	cvt.buf = malloc((size_t)length * cvt.len_mult);
+	memcpy(cvt.buf, samples, length);
+	SDL_FreeWAV(samples);
+	if (cvt.needed && SDL_ConvertAudio(&cvt) != 0) {
+		free(cvt.buf);
+		return 1;
+	}
+	const Uint32 size = cvt.needed ? cvt.len_cvt : length;
+
+	/* per process and thread, several games and threads may convert the same sound at once */
+	char *tmp = malloc(strlen(pcm) + 48);
+	sprintf(tmp, "%s.%ld.%lu.tmp", pcm, (long)getpid(), (unsigned long)SDL_ThreadID());
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) {
+		free(cvt.buf);
+		free(tmp);
+		return 1;
+	}
+	sound_pcm_header_t header = (sound_pcm_header_t) {SOUND_PCM_MAGIC, SOUND_PCM_VERSION, frequency, format, channels, size};
+	int error = fwrite(&header, sizeof(header), 1, f) != 1;
+	error |= size && fwrite(cvt.buf, size, 1, f) != 1;
+	error |= fclose(f) != 0;
+	free(cvt.buf);
+
+	if (error || rename(tmp, pcm) != 0) {
+		printf("Failed to write sound cache '%s'\n", pcm);
+		remove(tmp);
+		free(tmp);
+		return 1;
+	}
+	free(tmp);
+	return 0;
+}
+
+/*
+ * Maps the PCM cache `pcm` and makes a chunk playing from the mapping
+ * Returns NULL if the cache does not hold samples in the mixer format
+ */
+Mix_Chunk *sound_open_pcm(const char *pcm, void **mapping, size_t *mapping_size) {
+	int fd = open(pcm, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	sound_pcm_header_t header;
+	struct stat st;
+	if (read(fd, &header, sizeof(header)) != sizeof(header) || fstat(fd, &st) != 0
+	 || !sound_pcm_matches(&header) || header.size == 0 || (size_t)st.st_size != sizeof(header) + header.size) {
+		close(fd);
+		return NULL;
+	}
+
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	/* the chunk does not own its samples, sound_delete unmaps them */
+	Mix_Chunk *chunk = Mix_QuickLoad_RAW((Uint8 *)data + sizeof(header), header.size);
+	if (chunk == NULL) {
+		munmap(data, st.st_size);
+		return NULL;
+	}
+	*mapping = data;
+	*mapping_size = st.st_size;
+	return chunk;
+}
+
+/*
+ * Makes sure the PCM cache of `fn` is up to date
+ * Returns 0 if it is, sounds are loaded from the WAV when it cannot be written
+ */
+int sound_prepare_pcm(const char *fn) {
+	char *pcm = sound_pcm_file(fn);
+	const int error = !sound_pcm_fresh(fn, pcm) && sound_save_pcm(fn, pcm) != 0;
+	free(pcm);
+	return error;
+}
+
+/*
+ * Loads the sound effect `fn` and caches it
+ * It plays from the PCM cache if possible, else it is loaded from `rw`. `rw` may be NULL and is closed
+ * If `fn` is cached already, that chunk is used
+ */
+sound_t sound_new_rw(const char *fn, SDL_RWops *rw) {
+	SDL_AtomicLock(&sound_cache.lock);
 	sound_t snd = (sound_t) {
-		.chunk = Mix_LoadWAV(fn)
+		.chunk = sound_find(fn)
 	};
-	
+	SDL_AtomicUnlock(&sound_cache.lock);
+	if (snd.chunk) {
+		if (rw)
+			SDL_RWclose(rw);
+		return snd;
+	}
+
+	/* loaded without the lock, other threads keep using the cache meanwhile */
+	void *mapping = NULL;
+	size_t mapping_size = 0;
+	char *pcm = sound_pcm_file(fn);
+	if (sound_prepare_pcm(fn) == 0)
+		snd.chunk = sound_open_pcm(pcm, &mapping, &mapping_size);
+	free(pcm);
+
+	if (snd.chunk) {
+		if (rw)
+			SDL_RWclose(rw);
+	} else {
+		snd.chunk = Mix_LoadWAV_RW(rw, 1);
+	}
 	if (snd.chunk == NULL) {
 		printf("SDL_mixer error: failed to load sound effect '%s': %s\n", fn, Mix_GetError());
+		return snd;
+	}
+
+	SDL_AtomicLock(&sound_cache.lock);
+	/* another thread loaded it in the meantime */
+	Mix_Chunk *loaded = sound_find(fn);
+	if (loaded) {
+		SDL_AtomicUnlock(&sound_cache.lock);
+		Mix_FreeChunk(snd.chunk);
+		if (mapping)
+			munmap(mapping, mapping_size);
+		snd.chunk = loaded;
+		return snd;
+	}
+
+	if (sound_cache.entries_count == sound_cache.entries_max) {
+		sound_cache.entries_max = sound_cache.entries_max ? sound_cache.entries_max * 2 : 16;
+		sound_cache.entries = realloc(sound_cache.entries, sound_cache.entries_max * sizeof(sound_cache_entry_t));
 	}
+	sound_cache_entry_t *entry = &sound_cache.entries[sound_cache.entries_count++];
+	entry->path = malloc(strlen(fn) + 1);
+	strcpy(entry->path, fn);
+	entry->chunk = snd.chunk;
+	entry->refs = 1;
+	entry->pcm = mapping;
+	entry->pcm_size = mapping_size;
+	SDL_AtomicUnlock(&sound_cache.lock);
 
 	return snd;
 }
 
 /*
- * Cleans up `snd`
+ * Loads a new sound effect (currently only WAV)
+ * Files already loaded are not loaded again, the sound shares their chunk
+ * Files requested from the streaming worker are taken from there (see stream_finish)
+ */
+sound_t sound_new(const char *fn) {
+	/* no audio device (headless server), nothing to play on */
+	if (!Mix_QuerySpec(NULL, NULL, NULL))
+		return (sound_t) {NULL};
+
+	SDL_AtomicLock(&sound_cache.lock);
+	sound_t snd = (sound_t) {
+		.chunk = sound_find(fn)
+	};
+	SDL_AtomicUnlock(&sound_cache.lock);
+	if (snd.chunk)
+		return snd;
+
+	if (stream_finish(fn)) {
+		SDL_AtomicLock(&sound_cache.lock);
+		snd.chunk = sound_find(fn);
+		SDL_AtomicUnlock(&sound_cache.lock);
+		if (snd.chunk)
+			return snd;
+	}
+
+	/* packed sounds are read from the pack's mapping */
+	SDL_RWops *rw = pack_rwops(&game_pack, fn);
+	return sound_new_rw(fn, rw ? rw : SDL_RWFromFile(fn, "rb"));
+}
+
+/*
+ * Cleans up `snd`, the chunk is freed when no other sound uses it
  */
 void sound_delete(sound_t *snd) {
-	Mix_FreeChunk(snd->chunk);
+	if (snd->chunk == NULL)
+		return;
+
+	SDL_AtomicLock(&sound_cache.lock);
+	for (int i = 0; i < sound_cache.entries_count; ++i) {
+		sound_cache_entry_t *entry = &sound_cache.entries[i];
+		if (entry->chunk != snd->chunk)
+			continue;
+
+		if (--entry->refs == 0) {
+			Mix_FreeChunk(entry->chunk);
+			if (entry->pcm)
+				munmap(entry->pcm, entry->pcm_size);
+			free(entry->path);
+			*entry = sound_cache.entries[--sound_cache.entries_count];
+		}
+		break;
+	}
+	SDL_AtomicUnlock(&sound_cache.lock);
+	snd->chunk = NULL;
 }
 
 /*
- * Plays a sound
+ * Plays a sound at the end of the tick (see voices_flush)
  */
 void sound_play(sound_t *snd) {
-	Mix_PlayChannel(-1, snd->chunk, 0);
+	voices_trigger(snd->chunk, VOICE_PRIORITY_NORMAL, VOICE_LIMIT);
 }
 
 #endif
@@ -5,24 +5,58 @@
 #include <string.h>
 #include "sound.h"
 
+/*
+ * Named sounds
+ * soundatlas_add returns a handle that plays the sound without any lookup,
+ * names are found through an open addressing hash table of handles.
+ */
 typedef struct {
 	sound_t *sounds;
-	char **sound_names;
+	const char **sound_names;
+	/* voice priority and instance limit of every sound, see voices_trigger */
+	int *priorities, *limits;
 	int sounds_allocated, max_sounds;
 
+	/* handle + 1 per slot, 0 for empty slots, `slots_count` is a power of two */
+	int *slots;
+	int slots_count;
 } soundatlas_t;
 
+/*
+ * Returns the FNV-1a hash of `name`
+ */
+Uint32 soundatlas_hash(const char *name) {
+	Uint32 hash = 2166136261u;
+	for (; *name; ++name) {
+		hash ^= (Uint8)*name;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
 /*
  * Creates a new soundatlas
  */
 soundatlas_t soundatlas_new(int sounds_count) {
+	if (sounds_count < 1)
+		sounds_count = 1;
+	int slots_count = 4;
+	/* keep the table at most half full */
+	while (slots_count < sounds_count * 2) {
+		slots_count *= 2;
+	}
+
 	soundatlas_t sndatlas = (soundatlas_t) {
 		.sounds = malloc(sounds_count * sizeof(sound_t)),
 		.sound_names = malloc(sounds_count * sizeof(char*)),
+		.priorities = malloc(sounds_count * sizeof(int)),
+		.limits = malloc(sounds_count * sizeof(int)),
 		.sounds_allocated = 0,
-		.max_sounds = sounds_count
+		.max_sounds = sounds_count,
+		.slots = calloc(slots_count, sizeof(int)),
+		.slots_count = slots_count
 	};
-	
+
 	return sndatlas;
 }
 
@@ -30,43 +64,107 @@ soundatlas_t soundatlas_new(int sounds_count) {
  * Clean up soundatlas
  */
 void soundatlas_delete(soundatlas_t *sa) {
+	for (int i = 0; i < sa->sounds_allocated; ++i) {
+		sound_delete(&sa->sounds[i]);
+	}
 	free(sa->sounds);
 	free(sa->sound_names);
+	free(sa->priorities);
+	free(sa->limits);
+	free(sa->slots);
+}
+
+/*
+ * Puts `handle` into the hash table
+ */
+void soundatlas_insert(soundatlas_t *sa, int handle) {
+	const Uint32 mask = sa->slots_count - 1;
+	Uint32 slot = soundatlas_hash(sa->sound_names[handle]) & mask;
+	while (sa->slots[slot]) {
+		slot = (slot + 1) & mask;
+	}
+	sa->slots[slot] = handle + 1;
 }
 
 /*
  * Add a sound to the collection
+ * Returns the handle to pass to soundatlas_play_id
  */
-void soundatlas_add(soundatlas_t *sa, const char *fn, char *name) {
+int soundatlas_add(soundatlas_t *sa, const char *fn, const char *name) {
 	/* allocate new memory if we dont have enough */
-	if (sa->sounds_allocated == sa->max_sounds - 1) {
-		sa->max_sounds += 1;
+	if (sa->sounds_allocated == sa->max_sounds) {
+		sa->max_sounds *= 2;
 		sa->sounds = realloc(sa->sounds, sa->max_sounds * sizeof(sound_t));
 		sa->sound_names = realloc(sa->sound_names, sa->max_sounds * sizeof(char*));
+		sa->priorities = realloc(sa->priorities, sa->max_sounds * sizeof(int));
+		sa->limits = realloc(sa->limits, sa->max_sounds * sizeof(int));
 	}
-	
+
 	/* add sound to soundatlas */
-	sa->sounds[sa->sounds_allocated] = sound_new(fn);
-	sa->sound_names[sa->sounds_allocated] = name;
-	
-	sa->sounds_allocated += 1;
+	const int handle = sa->sounds_allocated++;
+	sa->sounds[handle] = sound_new(fn);
+	sa->sound_names[handle] = name;
+	sa->priorities[handle] = VOICE_PRIORITY_NORMAL;
+	sa->limits[handle] = VOICE_LIMIT;
+
+	/* grow the table, it keeps at most half of its slots used */
+	if (sa->sounds_allocated * 2 > sa->slots_count) {
+		free(sa->slots);
+		sa->slots_count *= 2;
+		sa->slots = calloc(sa->slots_count, sizeof(int));
+		for (int i = 0; i < handle; ++i) {
+			soundatlas_insert(sa, i);
+		}
+	}
+	soundatlas_insert(sa, handle);
+
+	return handle;
+}
+
+/*
+ * Returns the handle of the sound called `name`, -1 if there is none
+ */
+int soundatlas_find(soundatlas_t *sa, const char *name) {
+	const Uint32 mask = sa->slots_count - 1;
+	for (Uint32 slot = soundatlas_hash(name) & mask; sa->slots[slot]; slot = (slot + 1) & mask) {
+		const int handle = sa->slots[slot] - 1;
+		if (!strcmp(sa->sound_names[handle], name))
+			return handle;
+	}
+	return -1;
+}
+
+/*
+ * Sets the voice priority of the sound with `handle` and how many instances of it play at once
+ */
+void soundatlas_set_voice(soundatlas_t *sa, int handle, int priority, int limit) {
+	if (handle < 0 || handle >= sa->sounds_allocated)
+		return;
+	sa->priorities[handle] = priority;
+	sa->limits[handle] = limit;
+}
+
+/*
+ * Plays the sound with `handle` at the end of the tick
+ */
+void soundatlas_play_id(soundatlas_t *sa, int handle) {
+	if (handle >= 0 && handle < sa->sounds_allocated)
+		voices_trigger(sa->sounds[handle].chunk, sa->priorities[handle], sa->limits[handle]);
+}
+
+/*
+ * Plays the sound with `handle` at `x`,`y` on the map at the end of the tick
+ */
+void soundatlas_play_at(soundatlas_t *sa, int handle, float x, float y) {
+	if (handle >= 0 && handle < sa->sounds_allocated)
+		voices_trigger_at(sa->sounds[handle].chunk, sa->priorities[handle], sa->limits[handle], x, y);
 }
 
 /*
  * Plays a sound
  */
 void soundatlas_play(soundatlas_t *sa, const char *name) {
-	int sound_name_idx = -1;
-	for (int idx = 0; idx < sa->sounds_allocated; ++idx) {
-		if (!strcmp(sa->sound_names[idx], name)) {
-			sound_name_idx = idx;
-			break;
-		}
-	}
-	
-	
-	if (sound_name_idx > -1)
-		sound_play(&sa->sounds[sound_name_idx]);
+	soundatlas_play_id(sa, soundatlas_find(sa, name));
 }
 
 #endif
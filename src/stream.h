@@ -0,0 +1,419 @@
+#ifndef stream_h
+#define stream_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+/*
+ * Asset streaming
+ * A worker thread reads and decodes requested files into memory, highest
+ * priority first. The main thread turns them into textures and sounds in
+ * stream_update, within a time budget per frame, and puts them into the
+ * texture and sound caches. game_load_texture and sound_new of a requested
+ * file then either hit the cache or finish the request right away.
+ * The stream keeps a reference to everything it loaded until stream_shutdown.
+ * Only the main thread may call these functions, stream_finish does nothing
+ * on other threads, which load the files themselves.
+ */
+
+/* Kinds of requests */
+#define STREAM_TEXTURE 0
+#define STREAM_SOUND 1
+
+/* Requests of a higher priority are decoded first */
+#define STREAM_PRIORITY_LOW 0
+#define STREAM_PRIORITY_NORMAL 50
+#define STREAM_PRIORITY_HIGH 100
+
+/* States of requests */
+#define STREAM_QUEUED 0
+#define STREAM_LOADING 1
+#define STREAM_DECODED 2
+#define STREAM_DONE 3
+
+typedef struct {
+	char *path;
+	int kind;
+	int priority;
+	/* requests of the same priority are decoded in order */
+	Uint32 order;
+	int state;
+	/* position in the queue while queued */
+	int heap_index;
+
+	/* decoded by the worker */
+	SDL_Surface *surface;
+	Uint8 *data;
+	size_t size;
+
+	/* made by the main thread */
+	SDL_Texture *texture;
+	sound_t sound;
+} stream_request_t;
+
+typedef struct {
+	/* all requests, only used by the main thread */
+	stream_request_t **requests;
+	int requests_count, requests_max;
+	Uint32 order;
+
+	/* the rest is guarded by `mutex` */
+	/* queued requests, a binary max-heap by priority */
+	stream_request_t **heap;
+	int heap_count, heap_max;
+	/* decoded requests waiting for the main thread */
+	stream_request_t **decoded;
+	int decoded_count, decoded_max;
+	SDL_mutex *mutex;
+	/* signaled when requests are queued or decoded */
+	SDL_cond *cond;
+	SDL_Thread *thread;
+	int running;
+	/* thread that called stream_init */
+	SDL_threadID main_thread;
+} stream_t;
+
+stream_t game_stream = {
+	.requests = NULL,
+	.requests_count = 0,
+	.thread = NULL,
+	.running = 0
+};
+
+/*
+ * Returns 1 if `a` has to be decoded before `b`
+ */
+int stream_before(stream_request_t *a, stream_request_t *b) {
+	return a->priority > b->priority || (a->priority == b->priority && a->order < b->order);
+}
+
+/*
+ * Swaps heap entries `i` and `j`
+ */
+void stream_heap_swap(int i, int j) {
+	stream_request_t *r = game_stream.heap[i];
+	game_stream.heap[i] = game_stream.heap[j];
+	game_stream.heap[j] = r;
+	game_stream.heap[i]->heap_index = i;
+	game_stream.heap[j]->heap_index = j;
+}
+
+/*
+ * Moves heap entry `i` up until its parent goes first
+ */
+void stream_heap_up(int i) {
+	while (i > 0 && stream_before(game_stream.heap[i], game_stream.heap[(i - 1) / 2])) {
+		stream_heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+/*
+ * Moves heap entry `i` down until it goes before its children
+ */
+void stream_heap_down(int i) {
+	while (1) {
+		int first = i;
+		const int l = 2 * i + 1, r = 2 * i + 2;
+		if (l < game_stream.heap_count && stream_before(game_stream.heap[l], game_stream.heap[first]))
+			first = l;
+		if (r < game_stream.heap_count && stream_before(game_stream.heap[r], game_stream.heap[first]))
+			first = r;
+		if (first == i)
+			return;
+		stream_heap_swap(i, first);
+		i = first;
+	}
+}
+
+/*
+ * Takes heap entry `i` out of the queue
+ */
+void stream_heap_remove(int i) {
+	stream_heap_swap(i, --game_stream.heap_count);
+	game_stream.heap[game_stream.heap_count]->heap_index = -1;
+	if (i < game_stream.heap_count) {
+		stream_heap_up(i);
+		stream_heap_down(i);
+	}
+}
+
+/*
+ * Reads and decodes `r`, runs without holding the mutex
+ */
+void stream_decode(stream_request_t *r) {
+	if (r->kind == STREAM_TEXTURE) {
+		r->surface = game_load_surface(r->path);
+		return;
+	}
+
+	/* converted here, the main thread only maps the cache */
+	if (sound_prepare_pcm(r->path) == 0)
+		return;
+
+	const pack_index_t *entry = pack_find(&game_pack, r->path);
+	if (entry) {
+		/* fault the pages in here instead of on the main thread */
+		const volatile Uint8 *data = pack_data(&game_pack, entry);
+		for (size_t i = 0; i < entry->size; i += PACK_PAGE) {
+			(void)data[i];
+		}
+		return;
+	}
+
+	SDL_RWops *rw = SDL_RWFromFile(r->path, "rb");
+	if (rw == NULL) {
+		printf("Unable to stream '%s': %s\n", r->path, SDL_GetError());
+		return;
+	}
+	const Sint64 size = SDL_RWsize(rw);
+	r->data = malloc(size > 0 ? size : 1);
+	r->size = size > 0 ? SDL_RWread(rw, r->data, 1, size) : 0;
+	SDL_RWclose(rw);
+}
+
+/*
+ * Worker thread, decodes queued requests until stream_shutdown
+ */
+int stream_worker(void *unused) {
+	SDL_LockMutex(game_stream.mutex);
+	while (game_stream.running) {
+		if (game_stream.heap_count == 0) {
+			SDL_CondWait(game_stream.cond, game_stream.mutex);
+			continue;
+		}
+
+		stream_request_t *r = game_stream.heap[0];
+		stream_heap_remove(0);
+		r->state = STREAM_LOADING;
+		SDL_UnlockMutex(game_stream.mutex);
+
+		stream_decode(r);
+
+		SDL_LockMutex(game_stream.mutex);
+		r->state = STREAM_DECODED;
+		if (game_stream.decoded_count == game_stream.decoded_max) {
+			game_stream.decoded_max = game_stream.decoded_max ? game_stream.decoded_max * 2 : 16;
+			game_stream.decoded = realloc(game_stream.decoded, game_stream.decoded_max * sizeof(stream_request_t *));
+		}
+		game_stream.decoded[game_stream.decoded_count++] = r;
+		SDL_CondBroadcast(game_stream.cond);
+	}
+	SDL_UnlockMutex(game_stream.mutex);
+	return 0;
+}
+
+/*
+ * Starts the streaming worker
+ * Returns 0 on success, requests are ignored without it and assets load when they are used
+ */
+int stream_init() {
+	game_stream.mutex = SDL_CreateMutex();
+	game_stream.cond = SDL_CreateCond();
+	game_stream.running = 1;
+	game_stream.main_thread = SDL_ThreadID();
+	game_stream.thread = SDL_CreateThread(&stream_worker, "stream", NULL);
+	if (game_stream.thread == NULL) {
+		printf("Failed to create streaming thread: %s\n", SDL_GetError());
+		game_stream.running = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Turns decoded request `r` into a texture or sound in the caches
+ */
+void stream_finalize(stream_request_t *r) {
+	if (r->kind == STREAM_TEXTURE && r->surface) {
+		r->texture = game_cache_texture(r->path, r->surface);
+		SDL_FreeSurface(r->surface);
+		r->surface = NULL;
+	} else if (r->kind == STREAM_SOUND) {
+		SDL_RWops *rw = pack_rwops(&game_pack, r->path);
+		if (rw == NULL && r->data)
+			rw = SDL_RWFromConstMem(r->data, r->size);
+		r->sound = sound_new_rw(r->path, rw);
+		free(r->data);
+		r->data = NULL;
+	}
+	r->state = STREAM_DONE;
+}
+
+/*
+ * Takes `r` off the list of decoded requests, the mutex has to be held
+ */
+void stream_take_decoded(stream_request_t *r) {
+	for (int i = 0; i < game_stream.decoded_count; ++i) {
+		if (game_stream.decoded[i] == r) {
+			memmove(&game_stream.decoded[i], &game_stream.decoded[i + 1], (game_stream.decoded_count - i - 1) * sizeof(stream_request_t *));
+			--game_stream.decoded_count;
+			return;
+		}
+	}
+}
+
+/*
+ * Requests `path` of `kind` with `priority`
+ * A file requested again is moved up if the new priority is higher
+ */
+void stream_request(const char *path, int kind, int priority) {
+	if (!game_stream.running)
+		return;
+
+	for (int i = 0; i < game_stream.requests_count; ++i) {
+		stream_request_t *r = game_stream.requests[i];
+		if (strcmp(r->path, path))
+			continue;
+		SDL_LockMutex(game_stream.mutex);
+		if (r->state == STREAM_QUEUED && priority > r->priority) {
+			r->priority = priority;
+			stream_heap_up(r->heap_index);
+		}
+		SDL_UnlockMutex(game_stream.mutex);
+		return;
+	}
+
+	stream_request_t *r = calloc(1, sizeof(stream_request_t));
+	r->path = malloc(strlen(path) + 1);
+	strcpy(r->path, path);
+	r->kind = kind;
+	r->priority = priority;
+	r->order = game_stream.order++;
+	r->state = STREAM_QUEUED;
+
+	if (game_stream.requests_count == game_stream.requests_max) {
+		game_stream.requests_max = game_stream.requests_max ? game_stream.requests_max * 2 : 32;
+		game_stream.requests = realloc(game_stream.requests, game_stream.requests_max * sizeof(stream_request_t *));
+	}
+	game_stream.requests[game_stream.requests_count++] = r;
+
+	SDL_LockMutex(game_stream.mutex);
+	if (game_stream.heap_count == game_stream.heap_max) {
+		game_stream.heap_max = game_stream.heap_max ? game_stream.heap_max * 2 : 32;
+		game_stream.heap = realloc(game_stream.heap, game_stream.heap_max * sizeof(stream_request_t *));
+	}
+	r->heap_index = game_stream.heap_count;
+	game_stream.heap[game_stream.heap_count++] = r;
+	stream_heap_up(r->heap_index);
+	SDL_CondBroadcast(game_stream.cond);
+	SDL_UnlockMutex(game_stream.mutex);
+}
+
+/*
+ * Requests the texture of image `path`
+ */
+void stream_request_texture(const char *path, int priority) {
+	/* headless, nothing to draw to */
+	if (renderer != NULL)
+		stream_request(path, STREAM_TEXTURE, priority);
+}
+
+/*
+ * Requests the sound effect `path`
+ */
+void stream_request_sound(const char *path, int priority) {
+	/* no audio device, nothing to play on */
+	if (Mix_QuerySpec(NULL, NULL, NULL))
+		stream_request(path, STREAM_SOUND, priority);
+}
+
+/*
+ * Finishes decoded requests until `budget` milliseconds have passed
+ * At least one request is finished if there is any
+ */
+void stream_update(float budget) {
+	if (!game_stream.running)
+		return;
+
+	const Uint64 start = SDL_GetPerformanceCounter();
+	const Uint64 limit = budget * SDL_GetPerformanceFrequency() / 1000;
+	do {
+		SDL_LockMutex(game_stream.mutex);
+		stream_request_t *r = game_stream.decoded_count ? game_stream.decoded[0] : NULL;
+		if (r)
+			stream_take_decoded(r);
+		SDL_UnlockMutex(game_stream.mutex);
+		if (r == NULL)
+			return;
+
+		stream_finalize(r);
+	} while (SDL_GetPerformanceCounter() - start < limit);
+}
+
+/*
+ * Finishes the request of `path` now, decoding it here if the worker has not started on it
+ * Returns 0 if `path` was not requested or this is not the main thread
+ */
+int stream_finish(const char *path) {
+	/* the requests belong to the main thread, and so does finalizing them */
+	if (!game_stream.running || SDL_ThreadID() != game_stream.main_thread)
+		return 0;
+
+	stream_request_t *r = NULL;
+	for (int i = 0; i < game_stream.requests_count && r == NULL; ++i) {
+		if (!strcmp(game_stream.requests[i]->path, path))
+			r = game_stream.requests[i];
+	}
+	if (r == NULL)
+		return 0;
+	if (r->state == STREAM_DONE)
+		return 1;
+
+	SDL_LockMutex(game_stream.mutex);
+	if (r->state == STREAM_QUEUED) {
+		/* faster than waiting for the requests before it */
+		stream_heap_remove(r->heap_index);
+		r->state = STREAM_LOADING;
+		SDL_UnlockMutex(game_stream.mutex);
+		stream_decode(r);
+	} else {
+		while (r->state == STREAM_LOADING) {
+			SDL_CondWait(game_stream.cond, game_stream.mutex);
+		}
+		stream_take_decoded(r);
+		SDL_UnlockMutex(game_stream.mutex);
+	}
+
+	stream_finalize(r);
+	return 1;
+}
+
+/*
+ * Stops the worker and drops the stream's references to what it loaded
+ */
+void stream_shutdown() {
+	if (game_stream.thread) {
+		SDL_LockMutex(game_stream.mutex);
+		game_stream.running = 0;
+		SDL_CondBroadcast(game_stream.cond);
+		SDL_UnlockMutex(game_stream.mutex);
+		SDL_WaitThread(game_stream.thread, NULL);
+	}
+
+	for (int i = 0; i < game_stream.requests_count; ++i) {
+		stream_request_t *r = game_stream.requests[i];
+		game_release_texture(r->texture);
+		sound_delete(&r->sound);
+		if (r->surface)
+			SDL_FreeSurface(r->surface);
+		free(r->data);
+		free(r->path);
+		free(r);
+	}
+	free(game_stream.requests);
+	free(game_stream.heap);
+	free(game_stream.decoded);
+	SDL_DestroyCond(game_stream.cond);
+	SDL_DestroyMutex(game_stream.mutex);
+	game_stream = (stream_t) {
+		.requests = NULL,
+		.requests_count = 0,
+		.thread = NULL,
+		.running = 0
+	};
+}
+
+#endif
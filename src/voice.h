@@ -0,0 +1,279 @@
+#ifndef voice_h
+#define voice_h
+
+#include <stdlib.h>
+#include <math.h>
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_mixer.h>
+
+/*
+ * Voice management
+ * Sounds triggered during a tick are collected and started by voices_flush at
+ * its end. Triggers of the same sound in one tick become a single, louder
+ * voice. A sound plays at most `limit` times at once, a new instance replaces
+ * its oldest one. Without a free channel the least important voice (lowest
+ * priority, then farthest away, then oldest) makes room if it is less
+ * important than the new one, else the new one is dropped.
+ * Sounds with a position are panned by where they are in the viewport and fade
+ * out beyond it, sounds that would be inaudible never reach the mixer.
+ */
+
+#define VOICES_CHANNELS 32
+/* Instances of a sound playing at once, unless the sound says otherwise */
+#define VOICE_LIMIT 4
+#define VOICE_PRIORITY_LOW 0
+#define VOICE_PRIORITY_NORMAL 50
+#define VOICE_PRIORITY_HIGH 100
+/* Volume of a single trigger, leaves headroom for merged ones */
+#define VOICE_VOLUME (MIX_MAX_VOLUME * 3 / 4)
+/* Volume added by every further trigger merged into a voice, relative to VOICE_VOLUME */
+#define VOICE_MERGE_GAIN 0.25
+/* Sounds fade out over this many pixels outside the viewport */
+#define VOICE_FALLOFF 600
+/* Sounds quieter than this are not played at all */
+#define VOICE_MIN_GAIN 0.05
+
+/*
+ * Sound playing on a channel
+ */
+typedef struct {
+	Mix_Chunk *chunk;
+	int priority;
+	/* distance to the listener, 0 if it has no position */
+	float distance;
+	Uint32 started;
+	/* the channel is panned, see Mix_SetPanning */
+	int panned;
+} voice_t;
+
+/*
+ * Sound triggered during the current tick
+ */
+typedef struct {
+	Mix_Chunk *chunk;
+	int priority, limit;
+	float distance;
+	/* volume from 0 to 1 and pan from -1 (left) to 1 (right) of the nearest trigger */
+	float gain, pan;
+	/* times it was triggered */
+	int count;
+} voice_trigger_t;
+
+typedef struct {
+	voice_t voices[VOICES_CHANNELS];
+	int channels;
+	Uint32 started;
+	voice_trigger_t *pending;
+	int pending_count, pending_max;
+	/* viewport of the listener in map coordinates */
+	SDL_Rect view;
+	SDL_SpinLock lock;
+} voices_t;
+
+voices_t game_voices = {
+	.channels = 0,
+	.started = 0,
+	.pending = NULL,
+	.pending_count = 0,
+	.pending_max = 0,
+	.view = {0, 0, 0, 0},
+	.lock = 0
+};
+
+/*
+ * Reserves the mixer channels, call after Mix_OpenAudio
+ */
+void voices_init() {
+	game_voices.channels = Mix_AllocateChannels(VOICES_CHANNELS);
+	if (game_voices.channels > VOICES_CHANNELS)
+		game_voices.channels = VOICES_CHANNELS;
+	for (int i = 0; i < VOICES_CHANNELS; ++i) {
+		game_voices.voices[i] = (voice_t) {NULL, 0, 0, 0, 0};
+	}
+}
+
+/*
+ * Frees the triggers
+ */
+void voices_delete() {
+	free(game_voices.pending);
+	game_voices.pending = NULL;
+	game_voices.pending_count = game_voices.pending_max = 0;
+}
+
+/*
+ * Sets the viewport sounds are heard from, in map coordinates
+ */
+void voices_listen(int x, int y, int w, int h) {
+	SDL_AtomicLock(&game_voices.lock);
+	game_voices.view = (SDL_Rect) {x, y, w, h};
+	SDL_AtomicUnlock(&game_voices.lock);
+}
+
+/*
+ * Queues `chunk` with `gain` and `pan`, `distance` away from the listener
+ * game_voices.lock has to be held
+ */
+void voices_queue(Mix_Chunk *chunk, int priority, int limit, float distance, float gain, float pan) {
+	for (int i = 0; i < game_voices.pending_count; ++i) {
+		voice_trigger_t *t = &game_voices.pending[i];
+		if (t->chunk != chunk)
+			continue;
+		++t->count;
+		if (priority > t->priority)
+			t->priority = priority;
+		if (distance < t->distance)
+			t->distance = distance;
+		/* the merged voice is heard where it is loudest */
+		if (gain > t->gain) {
+			t->gain = gain;
+			t->pan = pan;
+		}
+		return;
+	}
+
+	if (game_voices.pending_count == game_voices.pending_max) {
+		game_voices.pending_max = game_voices.pending_max ? game_voices.pending_max * 2 : 16;
+		game_voices.pending = realloc(game_voices.pending, game_voices.pending_max * sizeof(voice_trigger_t));
+	}
+	game_voices.pending[game_voices.pending_count++] = (voice_trigger_t) {chunk, priority, limit > 0 ? limit : 1, distance, gain, pan, 1};
+}
+
+/*
+ * Triggers `chunk` without a position, it starts at the next voices_flush
+ * Up to `limit` instances of it play at once
+ */
+void voices_trigger(Mix_Chunk *chunk, int priority, int limit) {
+	if (chunk == NULL)
+		return;
+
+	SDL_AtomicLock(&game_voices.lock);
+	voices_queue(chunk, priority, limit, 0, 1, 0);
+	SDL_AtomicUnlock(&game_voices.lock);
+}
+
+/*
+ * Triggers `chunk` at `x`,`y` on the map, see voices_trigger
+ * It is panned by its position in the viewport and fades out beyond it,
+ * out of hearing range it is not played at all
+ */
+void voices_trigger_at(Mix_Chunk *chunk, int priority, int limit, float x, float y) {
+	if (chunk == NULL)
+		return;
+
+	SDL_AtomicLock(&game_voices.lock);
+	const SDL_Rect view = game_voices.view;
+	/* no viewport yet, everything is in front of the listener */
+	if (view.w <= 0 || view.h <= 0) {
+		voices_queue(chunk, priority, limit, 0, 1, 0);
+		SDL_AtomicUnlock(&game_voices.lock);
+		return;
+	}
+
+	const float half_w = view.w / 2.0, half_h = view.h / 2.0;
+	const float dx = x - (view.x + half_w), dy = y - (view.y + half_h);
+	/* distance to the edge of the viewport, 0 inside */
+	const float out_x = fabsf(dx) > half_w ? fabsf(dx) - half_w : 0,
+	            out_y = fabsf(dy) > half_h ? fabsf(dy) - half_h : 0;
+	const float gain = 1 - sqrtf(out_x * out_x + out_y * out_y) / VOICE_FALLOFF;
+	if (gain < VOICE_MIN_GAIN) {
+		SDL_AtomicUnlock(&game_voices.lock);
+		return;
+	}
+
+	float pan = dx / half_w;
+	if (pan < -1)
+		pan = -1;
+	if (pan > 1)
+		pan = 1;
+	voices_queue(chunk, priority, limit, sqrtf(dx * dx + dy * dy), gain, pan);
+	SDL_AtomicUnlock(&game_voices.lock);
+}
+
+/*
+ * Returns 1 if voice `a` is less important than voice `b`
+ */
+int voices_less(voice_t *a, voice_t *b) {
+	if (a->priority != b->priority)
+		return a->priority < b->priority;
+	if (a->distance != b->distance)
+		return a->distance > b->distance;
+	return a->started < b->started;
+}
+
+/*
+ * Returns the channel to play `t` on, -1 if it is dropped
+ */
+int voices_channel(voice_trigger_t *t) {
+	int instances = 0, oldest = -1, free_channel = -1, least = -1;
+	for (int i = 0; i < game_voices.channels; ++i) {
+		voice_t *v = &game_voices.voices[i];
+		if (!Mix_Playing(i)) {
+			if (free_channel < 0)
+				free_channel = i;
+			continue;
+		}
+		if (v->chunk == t->chunk) {
+			++instances;
+			if (oldest < 0 || v->started < game_voices.voices[oldest].started)
+				oldest = i;
+		}
+		if (least < 0 || voices_less(v, &game_voices.voices[least]))
+			least = i;
+	}
+
+	if (instances >= t->limit)
+		return oldest;
+	if (free_channel >= 0)
+		return free_channel;
+
+	voice_t candidate = (voice_t) {t->chunk, t->priority, t->distance, game_voices.started, 0};
+	if (least >= 0 && voices_less(&game_voices.voices[least], &candidate))
+		return least;
+	return -1;
+}
+
+/*
+ * Starts the sounds triggered since the last flush, call once per tick
+ */
+void voices_flush() {
+	SDL_AtomicLock(&game_voices.lock);
+	/* the most important triggers get channels first */
+	for (int i = 1; i < game_voices.pending_count; ++i) {
+		voice_trigger_t t = game_voices.pending[i];
+		int j = i;
+		for (; j > 0 && game_voices.pending[j - 1].priority < t.priority; --j) {
+			game_voices.pending[j] = game_voices.pending[j - 1];
+		}
+		game_voices.pending[j] = t;
+	}
+
+	for (int i = 0; i < game_voices.pending_count; ++i) {
+		voice_trigger_t *t = &game_voices.pending[i];
+		const int channel = voices_channel(t);
+		if (channel < 0)
+			continue;
+		if (Mix_Playing(channel))
+			Mix_HaltChannel(channel);
+
+		float volume = VOICE_VOLUME * t->gain * (1 + VOICE_MERGE_GAIN * (t->count - 1));
+		if (volume > MIX_MAX_VOLUME)
+			volume = MIX_MAX_VOLUME;
+		Mix_Volume(channel, volume);
+
+		/* the side the sound is on stays at full volume, the other one fades */
+		const int panned = t->pan != 0;
+		if (panned || game_voices.voices[channel].panned) {
+			Mix_SetPanning(channel, t->pan > 0 ? 255 * (1 - t->pan) : 255,
+				t->pan < 0 ? 255 * (1 + t->pan) : 255);
+		}
+
+		if (Mix_PlayChannel(channel, t->chunk, 0) < 0)
+			continue;
+		game_voices.voices[channel] = (voice_t) {t->chunk, t->priority, t->distance, ++game_voices.started, panned};
+	}
+	game_voices.pending_count = 0;
+	SDL_AtomicUnlock(&game_voices.lock);
+}
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * Sprite atlas packer
+ * Packs all PNG images found in the given directories into square pages and
+ * writes the pages and a manifest of named rects, which atlas_pages_load reads.
+ *
+ * Usage: atlaspack <output dir> <page size> <directories...>
+ * Images are named by their path relative to the working directory, without
+ * ".png". All images of one directory go onto the same page if they fit.
+ *
+ * Manifest lines:
+ *   page <index> <file>
+ *   sprite <page> <x> <y> <w> <h> <name>
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "lodepng.h"
+
+/* empty pixels between images, keeps filtering from bleeding over */
+#define PADDING 1
+#define MAX_PAGES 64
+
+typedef struct {
+	char *name;
+	unsigned char *pixels;
+	unsigned w, h;
+	int page, x, y;
+} image_t;
+
+/*
+ * Rows of images, filled left to right, new shelves are added below
+ */
+typedef struct {
+	int shelf_y, shelf_h, cursor_x;
+} page_t;
+
+image_t *images = NULL;
+int images_count = 0, images_max = 0;
+page_t pages[MAX_PAGES];
+int pages_count = 0;
+int page_size;
+
+/*
+ * Loads `path` and adds it to the images
+ */
+void add_image(const char *path) {
+	image_t img;
+	if (lodepng_decode32_file(&img.pixels, &img.w, &img.h, path)) {
+		printf("Skipping '%s': not a PNG\n", path);
+		return;
+	}
+	if ((int)img.w + PADDING > page_size || (int)img.h + PADDING > page_size) {
+		printf("Skipping '%s': larger than a page\n", path);
+		free(img.pixels);
+		return;
+	}
+
+	const size_t len = strlen(path) - 4;
+	img.name = malloc(len + 1);
+	memcpy(img.name, path, len);
+	img.name[len] = '\0';
+	img.page = -1;
+
+	if (images_count == images_max) {
+		images_max = images_max ? images_max * 2 : 256;
+		images = realloc(images, images_max * sizeof(image_t));
+	}
+	images[images_count++] = img;
+}
+
+int has_png_suffix(const char *name) {
+	const size_t len = strlen(name);
+	return len > 4 && !strcmp(name + len - 4, ".png");
+}
+
+int compare_names(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Adds the images of `dir` and calls `group` for every directory, subdirectories first
+ */
+void scan_dir(const char *dir, void (*group)(int, int)) {
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		printf("Cannot open directory '%s'\n", dir);
+		return;
+	}
+
+	/* sorted, so the output does not depend on the file system */
+	char **entries = NULL;
+	int count = 0, max = 0;
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+		if (count == max) {
+			max = max ? max * 2 : 64;
+			entries = realloc(entries, max * sizeof(char *));
+		}
+		entries[count] = malloc(strlen(dir) + strlen(e->d_name) + 2);
+		sprintf(entries[count++], "%s/%s", dir, e->d_name);
+	}
+	closedir(d);
+	qsort(entries, count, sizeof(char *), &compare_names);
+
+	const int first = images_count;
+	for (int i = 0; i < count; ++i) {
+		struct stat st;
+		if (stat(entries[i], &st) != 0)
+			continue;
+		if (S_ISDIR(st.st_mode))
+			scan_dir(entries[i], group);
+		else if (has_png_suffix(entries[i]))
+			add_image(entries[i]);
+	}
+
+	/* images of subdirectories were grouped already, move the others to the end */
+	int begin = images_count;
+	for (int i = images_count - 1; i >= first; --i) {
+		if (images[i].page >= 0)
+			continue;
+		const image_t img = images[i];
+		images[i] = images[--begin];
+		images[begin] = img;
+	}
+	group(begin, images_count);
+
+	for (int i = 0; i < count; ++i) {
+		free(entries[i]);
+	}
+	free(entries);
+}
+
+/*
+ * Places an image of `w` x `h` on `page`
+ * Returns 0 if it does not fit
+ */
+int place(page_t *page, int w, int h, int *x, int *y) {
+	w += PADDING;
+	h += PADDING;
+	if (page->cursor_x + w > page_size) {
+		page->shelf_y += page->shelf_h;
+		page->shelf_h = 0;
+		page->cursor_x = 0;
+	}
+	if (page->shelf_y + h > page_size)
+		return 0;
+
+	*x = page->cursor_x;
+	*y = page->shelf_y;
+	page->cursor_x += w;
+	if (h > page->shelf_h)
+		page->shelf_h = h;
+	return 1;
+}
+
+int compare_heights(const void *a, const void *b) {
+	const image_t *ia = a, *ib = b;
+	if (ia->h != ib->h)
+		return ia->h < ib->h ? 1 : -1;
+	return strcmp(ia->name, ib->name);
+}
+
+/*
+ * Packs images [`begin`, `end`) onto the first page that fits all of them
+ * Groups larger than a page are spread over new pages
+ */
+void pack_group(int begin, int end) {
+	if (begin == end)
+		return;
+	/* tallest first keeps shelves full */
+	qsort(&images[begin], end - begin, sizeof(image_t), &compare_heights);
+
+	for (int p = 0; p <= pages_count; ++p) {
+		if (p == MAX_PAGES) {
+			printf("Out of pages\n");
+			exit(1);
+		}
+		if (p == pages_count)
+			pages[pages_count++] = (page_t) {0, 0, 0};
+
+		page_t trial = pages[p];
+		int fits = 1;
+		for (int i = begin; i < end && fits; ++i) {
+			fits = place(&trial, images[i].w, images[i].h, &images[i].x, &images[i].y);
+		}
+		if (fits) {
+			pages[p] = trial;
+			for (int i = begin; i < end; ++i) {
+				images[i].page = p;
+			}
+			return;
+		}
+
+		/* does not even fit an empty page: fill pages one after another */
+		if (p == pages_count - 1 && pages[p].shelf_y == 0 && pages[p].cursor_x == 0) {
+			for (int i = begin; i < end; ++i) {
+				if (!place(&pages[pages_count - 1], images[i].w, images[i].h, &images[i].x, &images[i].y)) {
+					pages[pages_count++] = (page_t) {0, 0, 0};
+					place(&pages[pages_count - 1], images[i].w, images[i].h, &images[i].x, &images[i].y);
+				}
+				images[i].page = pages_count - 1;
+			}
+			return;
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 4) {
+		printf("Usage: %s <output dir> <page size> <directories...>\n", argv[0]);
+		return 1;
+	}
+	const char *out = argv[1];
+	page_size = atoi(argv[2]);
+	if (page_size <= 0) {
+		printf("Invalid page size '%s'\n", argv[2]);
+		return 1;
+	}
+
+	for (int i = 3; i < argc; ++i) {
+		scan_dir(argv[i], &pack_group);
+	}
+
+	mkdir(out, 0755);
+	char fn[4096];
+	sprintf(fn, "%s/atlas.txt", out);
+	FILE *manifest = fopen(fn, "w");
+	if (manifest == NULL) {
+		printf("Cannot write '%s'\n", fn);
+		return 1;
+	}
+
+	unsigned char *page = malloc((size_t)page_size * page_size * 4);
+	for (int p = 0; p < pages_count; ++p) {
+		memset(page, 0, (size_t)page_size * page_size * 4);
+		for (int i = 0; i < images_count; ++i) {
+			image_t *img = &images[i];
+			if (img->page != p)
+				continue;
+			for (unsigned y = 0; y < img->h; ++y) {
+				memcpy(&page[((size_t)(img->y + y) * page_size + img->x) * 4], &img->pixels[(size_t)y * img->w * 4], img->w * 4);
+			}
+		}
+
+		sprintf(fn, "%s/page%d.png", out, p);
+		unsigned error = lodepng_encode32_file(fn, page, page_size, page_size);
+		if (error) {
+			printf("Cannot write '%s': %s\n", fn, lodepng_error_text(error));
+			return 1;
+		}
+		fprintf(manifest, "page %d page%d.png\n", p, p);
+	}
+	for (int i = 0; i < images_count; ++i) {
+		image_t *img = &images[i];
+		fprintf(manifest, "sprite %d %d %d %u %u %s\n", img->page, img->x, img->y, img->w, img->h, img->name);
+	}
+	fclose(manifest);
+
+	printf("Packed %d images into %d pages of %dx%d\n", images_count, pages_count, page_size, page_size);
+	return 0;
+}
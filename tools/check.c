@@ -0,0 +1,203 @@
+/*
+ * Self checks of the terrain and player simulation, run by `make check`
+ * - edits: random edits applied through the edit buffer leave the same tiles
+ *   as applying them right away
+ * - deltas: a map following incremental deltas of the first one, some of them
+ *   from before forgotten history, ends up identical after every delta
+ * - players: more players than one job takes, simulated with one worker and
+ *   with several, end up in the same place, the time per tick is printed
+ * Runs headless from the repository root, returns 1 if a check fails.
+ */
+#define main game_main
+#include "../src/main.c"
+#undef main
+
+/*
+ * Creates a map of `w` x `h` with random background and terrain
+ */
+map_t check_map(const int w, const int h) {
+	map_t map = map_new(w, h);
+	for (int i = 0; i < w * h; ++i) {
+		map.back_rgb_tiles[i] = rand() & 0xFFFFFF;
+	}
+	for (int i = 0; i < w * h; ++i) {
+		const int solid = rand() % 10 < 7;
+		map_set_solid(&map, i % w, i / w, solid ? rand() & 0xFFFFFF : 0, solid);
+	}
+	return map;
+}
+
+/*
+ * Returns 1 if `a` and `b` have the same tiles
+ */
+int check_same_tiles(map_t *a, map_t *b) {
+	return !memcmp(a->rgb_tiles, b->rgb_tiles, a->width * a->height * sizeof(Uint32))
+		&& !memcmp(a->solid_tiles, b->solid_tiles, a->width * a->height);
+}
+
+/*
+ * What map_explode does, applied right away
+ */
+void check_explode_now(map_t *map, const int xp, const int yp, const int r, const int wd, Uint32 c) {
+	for (int x = -r; x <= r; ++x) {
+		for (int y = -r; y <= r; ++y) {
+			if (x * x + y * y <= r * r && map_in_bounds(map, xp + x, yp + y) && map_get_solid(map, xp + x, yp + y))
+				map_set_solid(map, xp + x, yp + y, c, 1);
+		}
+	}
+	map_set_circle(map, xp, yp, r - wd, 0, 0);
+}
+
+int check_edits() {
+	const int w = 700, h = 500;
+	srand(3);
+	map_t now = check_map(w, h);
+	srand(3);
+	map_t queued = check_map(w, h);
+
+	int failed = 0;
+	for (int round = 0; round < 50 && !failed; ++round) {
+		for (int n = 1 + rand() % 30; n > 0; --n) {
+			/* reaching over the border on purpose */
+			int x = rand() % (w + 40) - 20, y = rand() % (h + 40) - 20;
+			const int r = rand() % 40, wd = rand() % 8, solid = rand() % 2;
+			const Uint32 c = rand() & 0xFFFFFF;
+			switch (rand() % 3) {
+				case 0:
+					map_set_circle(&now, x, y, r, c, solid);
+					map_edit_circle(&queued, x, y, r, c, solid);
+					break;
+				case 1:
+					x = 30 + rand() % (w - 60);
+					y = 30 + rand() % (h - 60);
+					map_set_rect(&now, x, y, r % 50, wd * 3, c, solid);
+					map_edit_rect(&queued, x, y, r % 50, wd * 3, c, solid);
+					break;
+				default:
+					check_explode_now(&now, x, y, r, wd, c);
+					map_explode(&queued, x, y, r, wd, c);
+			}
+		}
+		map_apply_edits(&queued);
+		failed = !check_same_tiles(&now, &queued);
+	}
+
+	printf("edits: %s\n", failed ? "FAILED, merged edits differ from immediate ones" : "ok");
+	map_delete(&now);
+	map_delete(&queued);
+	return failed;
+}
+
+int check_deltas() {
+	const int w = 1000, h = 700;
+	srand(5);
+	map_t sender = check_map(w, h);
+	srand(5);
+	map_t receiver = check_map(w, h);
+	delta_t delta = delta_new();
+	sender.delta = &delta;
+
+	int failed = 0;
+	Uint32 since = 0;
+	for (int round = 0; round < 8 && !failed; ++round) {
+		for (int t = 0; t < 60; ++t) {
+			++sender.tick;
+			for (int n = rand() % 4; n > 0; --n) {
+				map_explode(&sender, rand() % w, 300 + rand() % 400, 5 + rand() % 30, 4, rand() & 0xFFFFFF);
+			}
+			if (rand() % 10 == 0)
+				map_edit_rect(&sender, rand() % w, rand() % h, 30, 14, rand() & 0xFFFFFF, 1);
+			map_apply_edits(&sender);
+			/* like sand and islands, outside the edit buffer, kept to one corner so most chunks only see edits */
+			for (int n = 0; n < 5; ++n) {
+				map_set_solid(&sender, rand() % 200, rand() % 200, rand() & 0xFFFFFF, rand() % 2);
+			}
+		}
+
+		/* every other delta has to be sent as tiles */
+		if (round % 2)
+			delta_forget(&delta, sender.tick);
+
+		int size;
+		Uint8 *data = delta_encode(&delta, &sender, since, &size);
+		failed = size > delta_max_size(&sender) || delta_apply(&receiver, data, size) || !check_same_tiles(&sender, &receiver);
+		free(data);
+		delta_forget(&delta, since);
+		since = sender.tick;
+	}
+
+	printf("deltas: %s\n", failed ? "FAILED, the receiver differs from the sender" : "ok");
+	delta_delete(&delta);
+	map_delete(&sender);
+	map_delete(&receiver);
+	return failed;
+}
+
+/*
+ * Simulates `count` players for `ticks` ticks with `threads` workers, stores where they end up in `pos`
+ */
+void check_run_players(const int threads, const int count, const int ticks, vector_t *pos) {
+	jobs_init(threads);
+	map_t map = map_new(2000, 800);
+	for (int y = 400; y < 800; ++y) {
+		for (int x = 0; x < 2000; ++x) {
+			map_set_solid(&map, x, y, RGB(100, 50, 20), 1);
+		}
+	}
+	particles_t ps = particles_new(1000);
+	map.particles = &ps;
+
+	players_t pl = players_new(count, "settings/player.js");
+	for (int i = 0; i < count; ++i) {
+		players_add(&pl, 100 + (i * 29) % 1800, 200);
+	}
+
+	const Uint64 start = SDL_GetPerformanceCounter();
+	for (int t = 0; t < ticks; ++t) {
+		++map.tick;
+		for (int i = 0; i < count; ++i) {
+			pl.inputs[i] = (player_input_t) {
+				.move = (t / 100 + i) % 3 - 1,
+				.buttons = ((t + i) % 50 == 0 ? PLAYER_JUMP : 0) | ((t + i) % 200 == 0 ? PLAYER_FIRE : 0),
+				.aim = vector_new(1000, 100)
+			};
+		}
+		players_update(&pl, &map);
+		map_apply_edits(&map);
+	}
+	printf("players: %d with %d workers take %.3f ms per tick\n", count, threads,
+		(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency() / ticks);
+
+	for (int i = 0; i < count; ++i) {
+		pos[i] = pl.players[i].pos;
+	}
+	players_delete(&pl);
+	particles_delete(&ps);
+	map_delete(&map);
+	jobs_shutdown();
+}
+
+int check_players() {
+	/* several jobs of PLAYERS_JOB_SIZE, on several workers even on a single core */
+	const int workers = SDL_GetCPUCount() > 4 ? SDL_GetCPUCount() : 4;
+	vector_t serial[4 * PLAYERS_JOB_SIZE], parallel[4 * PLAYERS_JOB_SIZE];
+	check_run_players(1, 4 * PLAYERS_JOB_SIZE, 600, serial);
+	check_run_players(workers, 4 * PLAYERS_JOB_SIZE, 600, parallel);
+	const int failed = memcmp(serial, parallel, sizeof(serial)) != 0;
+	printf("players: %s\n", failed ? "FAILED, results depend on the workers" : "ok");
+	return failed;
+}
+
+int main(int argc, char *argv[]) {
+	if (game_init_headless() != 0)
+		return 1;
+
+	jobs_init(SDL_GetCPUCount());
+	int failed = check_edits();
+	failed |= check_deltas();
+	jobs_shutdown();
+	failed |= check_players();
+
+	SDL_Quit();
+	return failed;
+}
@@ -0,0 +1,243 @@
+/*
+ * Asset pack builder
+ * Writes all files found in the given directories into one pack, which the game
+ * maps at startup instead of opening every file (see src/pack.h).
+ *
+ * Usage: pack <output> [-d <prefix>]... <directories...>
+ * Files are named by their path relative to the working directory. PNG images
+ * whose path starts with one of the `-d` prefixes are stored decoded to RGBA,
+ * which costs space but no decoding when they are loaded.
+ * Thumbs.db, .meta files, level and sound caches and hidden files are left out.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "lodepng.h"
+
+/* Has to match src/pack.h */
+#define PACK_MAGIC 0x4B434150
+#define PACK_VERSION 1
+#define PACK_ALIGN 64
+#define PACK_PAGE 4096
+#define PACK_RGBA 1
+
+typedef struct {
+	uint32_t magic, version;
+	uint32_t entries_count;
+	uint32_t names_size;
+} pack_header_t;
+
+typedef struct {
+	uint32_t name;
+	uint32_t flags;
+	uint32_t width, height;
+	uint64_t offset, size;
+} pack_index_t;
+
+typedef struct {
+	char *name;
+	unsigned char *data;
+	size_t size;
+	uint32_t flags;
+	unsigned width, height;
+} file_t;
+
+file_t *files = NULL;
+int files_count = 0, files_max = 0;
+const char **decode = NULL;
+int decode_count = 0;
+
+int has_suffix(const char *name, const char *suffix) {
+	const size_t len = strlen(name), suffix_len = strlen(suffix);
+	return len > suffix_len && !strcmp(name + len - suffix_len, suffix);
+}
+
+/*
+ * Returns 1 if `name` belongs in the pack
+ */
+int wanted(const char *name) {
+	const char *base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+	/* caches the game writes next to the levels and sounds are no assets either */
+	return base[0] != '.' && strcmp(base, "Thumbs.db") && !has_suffix(base, ".meta")
+		&& !has_suffix(base, ".cache") && !has_suffix(base, ".pcm") && !has_suffix(base, ".tmp");
+}
+
+/*
+ * Returns 1 if the image `path` is stored decoded
+ */
+int decoded(const char *path) {
+	if (!has_suffix(path, ".png") && !has_suffix(path, ".PNG"))
+		return 0;
+	for (int i = 0; i < decode_count; ++i) {
+		if (!strncmp(path, decode[i], strlen(decode[i])))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Reads `path` and adds it to the files
+ */
+void add_file(const char *path) {
+	file_t file = (file_t) {NULL, NULL, 0, 0, 0, 0};
+
+	if (decoded(path)) {
+		unsigned error = lodepng_decode32_file(&file.data, &file.width, &file.height, path);
+		if (error) {
+			printf("Skipping '%s': %s\n", path, lodepng_error_text(error));
+			return;
+		}
+		file.size = (size_t)file.width * file.height * 4;
+		file.flags = PACK_RGBA;
+	} else {
+		FILE *f = fopen(path, "rb");
+		if (f == NULL) {
+			printf("Skipping '%s': cannot open it\n", path);
+			return;
+		}
+		fseek(f, 0, SEEK_END);
+		file.size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		file.data = malloc(file.size ? file.size : 1);
+		if (fread(file.data, 1, file.size, f) != file.size) {
+			printf("Skipping '%s': cannot read it\n", path);
+			free(file.data);
+			fclose(f);
+			return;
+		}
+		fclose(f);
+	}
+
+	file.name = malloc(strlen(path) + 1);
+	strcpy(file.name, path);
+	if (files_count == files_max) {
+		files_max = files_max ? files_max * 2 : 256;
+		files = realloc(files, files_max * sizeof(file_t));
+	}
+	files[files_count++] = file;
+}
+
+int compare_names(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Adds the files of `dir` and its subdirectories
+ */
+void scan_dir(const char *dir) {
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		printf("Cannot open directory '%s'\n", dir);
+		return;
+	}
+
+	while (1) {
+		struct dirent *e = readdir(d);
+		if (e == NULL)
+			break;
+		if (!wanted(e->d_name))
+			continue;
+
+		char *path = malloc(strlen(dir) + strlen(e->d_name) + 2);
+		sprintf(path, "%s/%s", dir, e->d_name);
+		struct stat st;
+		if (stat(path, &st) == 0) {
+			if (S_ISDIR(st.st_mode))
+				scan_dir(path);
+			else if (S_ISREG(st.st_mode))
+				add_file(path);
+		}
+		free(path);
+	}
+	closedir(d);
+}
+
+/*
+ * Returns `offset` rounded up to a multiple of `align`
+ */
+uint64_t align_up(uint64_t offset, uint64_t align) {
+	return (offset + align - 1) / align * align;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 3) {
+		printf("Usage: %s <output> [-d <prefix>]... <directories...>\n", argv[0]);
+		return 1;
+	}
+	const char *out = argv[1];
+
+	decode = malloc(argc * sizeof(char *));
+	int dirs = 0;
+	for (int i = 2; i < argc; ++i) {
+		if (!strcmp(argv[i], "-d") && i + 1 < argc)
+			decode[decode_count++] = argv[++i];
+		else
+			argv[2 + dirs++] = argv[i];
+	}
+	for (int i = 0; i < dirs; ++i) {
+		/* names have to match the paths the game opens */
+		char *dir = argv[2 + i];
+		while (strlen(dir) > 1 && dir[strlen(dir) - 1] == '/')
+			dir[strlen(dir) - 1] = '\0';
+		scan_dir(dir);
+	}
+
+	/* the game looks names up by binary search */
+	qsort(files, files_count, sizeof(file_t), &compare_names);
+
+	uint32_t names_size = 0;
+	for (int i = 0; i < files_count; ++i) {
+		names_size += strlen(files[i].name) + 1;
+	}
+
+	pack_index_t *index = calloc((size_t)files_count + 1, sizeof(pack_index_t));
+	uint64_t offset = sizeof(pack_header_t) + (uint64_t)files_count * sizeof(pack_index_t) + names_size;
+	uint32_t name = 0;
+	for (int i = 0; i < files_count; ++i) {
+		if (files[i].size)
+			offset = align_up(offset, (files[i].flags & PACK_RGBA) ? PACK_PAGE : PACK_ALIGN);
+		index[i] = (pack_index_t) {name, files[i].flags, files[i].width, files[i].height, offset, files[i].size};
+		name += strlen(files[i].name) + 1;
+		offset += files[i].size;
+	}
+
+	/* written next to the output and renamed, a running game keeps its mapping of the old pack */
+	char *tmp = malloc(strlen(out) + 5);
+	sprintf(tmp, "%s.tmp", out);
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) {
+		printf("Cannot write '%s'\n", tmp);
+		return 1;
+	}
+
+	pack_header_t header = (pack_header_t) {PACK_MAGIC, PACK_VERSION, files_count, names_size};
+	int error = fwrite(&header, sizeof(header), 1, f) != 1;
+	error |= fwrite(index, sizeof(pack_index_t), files_count, f) != (size_t)files_count;
+	for (int i = 0; i < files_count; ++i) {
+		error |= fwrite(files[i].name, strlen(files[i].name) + 1, 1, f) != 1;
+	}
+	for (int i = 0; i < files_count && !error; ++i) {
+		error |= fseek(f, index[i].offset, SEEK_SET) != 0;
+		error |= files[i].size && fwrite(files[i].data, files[i].size, 1, f) != 1;
+	}
+	error |= fclose(f) != 0;
+
+	if (error || rename(tmp, out) != 0) {
+		printf("Cannot write '%s'\n", out);
+		remove(tmp);
+		return 1;
+	}
+
+	int pixels = 0;
+	for (int i = 0; i < files_count; ++i) {
+		pixels += (files[i].flags & PACK_RGBA) != 0;
+	}
+	printf("Packed %d files (%d decoded images) into '%s', %llu bytes\n", files_count, pixels, out, (unsigned long long)offset);
+	return 0;
+}